@@ -1,5 +1,6 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <stdexcept>
@@ -8,11 +9,66 @@
 #include <limits>
 #include <algorithm>
 #include <cctype>
+#include <cstring>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <cerrno>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#ifdef __linux__  // mapped index, server and shared-memory ring
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 using uint64 = unsigned long long;
 
-const uint64 MOD = 10000000000007ULL;
+// Substring hashes are polynomials modulo the Mersenne prime 2^61 - 1 with a base
+// drawn per index, and tables place keys through a keyed mix of the hash, so no
+// fixed input can force collisions or long probe chains. Segments are verified
+// exactly against the sequences before they are reported.
+const uint64 MOD = (1ULL << 61) - 1;
+const int HASH_VERIFY_ATTEMPTS = 3;
+
+uint64 splitmix64(uint64 x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Per-run seed (random unless --seed is given); every index derives its own key
+uint64 hash_run_seed = 0;
+atomic<uint64> hash_key_counter{0};
+
+struct SeededHash {
+    uint64 base = 5;
+    uint64 seed = 0;
+    bool bisulfite = false;  // keys hash the C->T converted strand
+    size_t operator()(uint64 key) const { return splitmix64(key ^ seed); }
+};
+
+SeededHash new_hash_key() {
+    const uint64 n = hash_key_counter++;
+    const uint64 a = splitmix64(hash_run_seed ^ splitmix64(2 * n));
+    const uint64 b = splitmix64(hash_run_seed ^ splitmix64(2 * n + 1));
+    return SeededHash{(1ULL << 20) + a % (MOD - (1ULL << 21)), b};
+}
 
 // Helper: Trim whitespace
 string trim(const string &s) {
@@ -56,12 +112,41 @@ uint64 dna_to_num(char dna) {
     }
 }
 
+char complement_base(char c) {
+    switch(c) {
+        case 'A': return 'T';
+        case 'T': return 'A';
+        case 'C': return 'G';
+        case 'G': return 'C';
+        default:
+            throw runtime_error("Invalid DNA character: '" + string(1, c) + "'");
+    }
+}
+
+// hash * base + code (mod 2^61 - 1)
+uint64 hash_step(uint64 hash, uint64 base, char dna) {
+    const unsigned __int128 x = static_cast<unsigned __int128>(hash) * base + dna_to_num(dna);
+    uint64 r = static_cast<uint64>(x & MOD) + static_cast<uint64>(x >> 61);
+    r = (r & MOD) + (r >> 61);
+    return r >= MOD ? r - MOD : r;
+}
+
+// Bisulfite reads carry T wherever the sequenced strand had an unmethylated C.
+// Converted indexes hash both strands with C read as T (the reverse strand of
+// the C->T top strand index is the G->A converted reference), and queries are
+// converted the same way while they are hashed; positions are unchanged.
+char bisulfite_base(char c) {
+    return c == 'C' ? 'T' : c;
+}
+
 struct RefSeq {
     uint64 start;
     uint64 end;
     bool reverse;
 };
 
+using RefMap = unordered_map<uint64, RefSeq, SeededHash>;
+
 struct Trace {
     RefSeq ref_seq;
     uint64 next;
@@ -69,22 +154,27 @@ struct Trace {
     uint64 query_end;
 };
 
-void build_reference_hash(const string &dna, unordered_map<uint64, RefSeq> &map, bool reverse) {
+// offset shifts the recorded positions when dna is a slice of a longer reference;
+// substrings longer than max_len (the longest query to be looked up) are skipped
+void build_reference_hash(const string &dna, RefMap &map, bool reverse, uint64 offset = 0,
+                          size_t max_len = SIZE_MAX) {
     const size_t dna_len = dna.size();
     const string seq = reverse ? reverse_dna(dna) : dna;
+    const uint64 base = map.hash_function().base;
+    const bool convert = map.hash_function().bisulfite;
     
     for (size_t start = 0; start < dna_len; ++start) {
         uint64 hash = 0;
-        for (size_t end = start; end < dna_len; ++end) {
-            hash = (hash * 5 + dna_to_num(seq[end])) % MOD;
+        for (size_t end = start; end < dna_len && end - start < max_len; ++end) {
+            hash = hash_step(hash, base, convert ? bisulfite_base(seq[end]) : seq[end]);
             if (map.find(hash) == map.end()) {
                 RefSeq ref;
                 if (reverse) {
-                    ref.start = dna_len - end - 1;
-                    ref.end = dna_len - start - 1;
+                    ref.start = dna_len - end - 1 + offset;
+                    ref.end = dna_len - start - 1 + offset;
                 } else {
-                    ref.start = start;
-                    ref.end = end;
+                    ref.start = start + offset;
+                    ref.end = end + offset;
                 }
                 ref.reverse = reverse;
                 map[hash] = ref;
@@ -93,8 +183,12 @@ void build_reference_hash(const string &dna, unordered_map<uint64, RefSeq> &map,
     }
 }
 
-vector<optional<Trace>> find_optimal_path(const string &query, const unordered_map<uint64, RefSeq> &ref_map) {
+// Index is RefMap or any read-only table with the same find/end/hash_function interface
+template <class Index>
+vector<optional<Trace>> find_optimal_path(string_view query, const Index &ref_map) {
     const size_t query_len = query.size();
+    const uint64 base = ref_map.hash_function().base;
+    const bool convert = ref_map.hash_function().bisulfite;
     vector<uint64> dp(query_len + 1, numeric_limits<uint64_t>::max() - 20);
     dp[query_len] = 0;
     vector<optional<Trace>> trace(query_len + 1, nullopt);
@@ -102,7 +196,7 @@ vector<optional<Trace>> find_optimal_path(const string &query, const unordered_m
     for (int start = query_len - 1; start >= 0; --start) {
         uint64 hash = 0;
         for (size_t end = start; end < query_len; ++end) {
-            hash = (hash * 5 + dna_to_num(query[end])) % MOD;
+            hash = hash_step(hash, base, convert ? bisulfite_base(query[end]) : query[end]);
             if (const auto it = ref_map.find(hash); it != ref_map.end()) {
                 const uint64 new_cost = dp[end + 1] + 1;
                 if (new_cost < dp[start] || (new_cost == dp[start] && !it->second.reverse)) {
@@ -136,6 +230,534 @@ vector<MatchSegment> reconstruct_path(const vector<optional<Trace>> &trace, size
     return result;
 }
 
+// Reference interval, 0-based inclusive like the reported positions
+struct RefRegion {
+    uint64 start;
+    uint64 end;
+};
+
+// Sorted, merged and checked against the reference length
+vector<RefRegion> normalize_regions(vector<RefRegion> regions, size_t ref_len) {
+    for (const RefRegion &r : regions) {
+        if (r.start > r.end || r.end >= ref_len) {
+            throw runtime_error("Region " + to_string(r.start) + "-" + to_string(r.end) +
+                                " is outside the reference (length " + to_string(ref_len) + ")");
+        }
+    }
+    sort(regions.begin(), regions.end(), [](const RefRegion &a, const RefRegion &b) { return a.start < b.start; });
+    vector<RefRegion> merged;
+    for (const RefRegion &r : regions) {
+        if (!merged.empty() && r.start <= merged.back().end + 1) merged.back().end = max(merged.back().end, r.end);
+        else merged.push_back(r);
+    }
+    return merged;
+}
+
+// Two-strand index of ref under a fresh hash key. With regions, only substrings
+// inside one region are indexed, so the build shrinks with the regions and
+// lookups can never return a position outside them. Every forward strand goes in
+// before any reverse strand, so a substring found on both keeps its forward entry.
+RefMap build_reference_index(const string &ref, const vector<RefRegion> &regions = {}, bool bisulfite = false) {
+    SeededHash key = new_hash_key();
+    key.bisulfite = bisulfite;
+    RefMap map(0, key);
+    if (regions.empty()) {
+        build_reference_hash(ref, map, false);
+        build_reference_hash(ref, map, true);
+        return map;
+    }
+    for (const bool reverse : {false, true}) {
+        for (const RefRegion &r : regions) {
+            build_reference_hash(ref.substr(r.start, r.end - r.start + 1), map, reverse, r.start);
+        }
+    }
+    return map;
+}
+
+// Exact check of segments against the sequences (compared C->T converted for
+// bisulfite indexes); a failure means a hash collision
+bool verify_segments(string_view query, const string &ref, const vector<MatchSegment> &segments,
+                     bool bisulfite = false) {
+    for (const MatchSegment &seg : segments) {
+        const size_t len = seg.query_end - seg.query_start + 1;
+        if (seg.ref_info.end - seg.ref_info.start + 1 != len || seg.ref_info.end >= ref.size()) return false;
+        for (size_t k = 0; k < len; ++k) {
+            const char q = query[seg.query_start + k];
+            const char r = seg.ref_info.reverse ? complement_base(ref[seg.ref_info.end - k]) : ref[seg.ref_info.start + k];
+            if (bisulfite ? bisulfite_base(r) != bisulfite_base(q) : r != q) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// find_optimal_path + reconstruct_path; on a verification failure the index is
+// rebuilt under a new key, so reported segments never depend on the key drawn
+vector<MatchSegment> segment_verified(string_view query, const string &ref, RefMap &ref_map,
+                                      const vector<RefRegion> &regions = {}) {
+    const bool bisulfite = ref_map.hash_function().bisulfite;
+    for (int attempt = 1;; ++attempt) {
+        auto segments = reconstruct_path(find_optimal_path(query, ref_map), query.size());
+        if (verify_segments(query, ref, segments, bisulfite)) return segments;
+        if (attempt == HASH_VERIFY_ATTEMPTS) {
+            throw runtime_error("Segment verification failed after " + to_string(attempt) + " hash keys");
+        }
+        ref_map = build_reference_index(ref, regions, bisulfite);
+    }
+}
+
+// Strand pre-detection: a read from one strand needs only that strand's
+// substrings. Sampled k-mers vote by where they occur: on the forward strand
+// when the k-mer has a forward entry, on the reverse strand when its reverse
+// complement has one. The forward strands of all regions are indexed before
+// any reverse strand, so every forward substring has a forward entry, and that set is closed under
+// taking substrings: a one-strand DP row stops at its first miss instead of
+// probing to the end of the query. Reverse reads are reverse-complemented.
+const size_t STRAND_VOTE_K = 20;
+const size_t STRAND_VOTE_SAMPLES = 16;
+const size_t STRAND_MIN_VOTES = 2;  // and none for the other strand
+
+// +1 forward, -1 reverse, 0 when the votes are mixed (inversions) or too few
+template <class Index>
+int vote_strand(string_view query, const Index &ref_map) {
+    if (query.size() < STRAND_VOTE_K) return 0;
+    const uint64 base = ref_map.hash_function().base;
+    auto on_forward = [&](string_view kmer) {
+        uint64 hash = 0;
+        for (const char c : kmer) hash = hash_step(hash, base, c);
+        const auto it = ref_map.find(hash);
+        return it != ref_map.end() && !it->second.reverse;
+    };
+    size_t forward = 0, reverse = 0;
+    string rc(STRAND_VOTE_K, 'A');
+    for (size_t s = 0; s < STRAND_VOTE_SAMPLES; ++s) {
+        const string_view kmer = query.substr((query.size() - STRAND_VOTE_K) * s / (STRAND_VOTE_SAMPLES - 1), STRAND_VOTE_K);
+        for (size_t i = 0; i < STRAND_VOTE_K; ++i) rc[i] = complement_base(kmer[STRAND_VOTE_K - 1 - i]);
+        const bool fwd = on_forward(kmer), rev = on_forward(rc);
+        if (fwd != rev) ++(fwd ? forward : reverse);
+    }
+    if (forward >= STRAND_MIN_VOTES && reverse == 0) return 1;
+    if (reverse >= STRAND_MIN_VOTES && forward == 0) return -1;
+    return 0;
+}
+
+template <class Index>
+vector<optional<Trace>> find_forward_path(string_view query, const Index &ref_map) {
+    const size_t query_len = query.size();
+    const uint64 base = ref_map.hash_function().base;
+    vector<uint64> dp(query_len + 1, numeric_limits<uint64_t>::max() - 20);
+    dp[query_len] = 0;
+    vector<optional<Trace>> trace(query_len + 1, nullopt);
+
+    for (int start = query_len - 1; start >= 0; --start) {
+        uint64 hash = 0;
+        for (size_t end = start; end < query_len; ++end) {
+            hash = hash_step(hash, base, query[end]);
+            const auto it = ref_map.find(hash);
+            if (it == ref_map.end() || it->second.reverse) break;
+            if (dp[end + 1] + 1 < dp[start]) {
+                dp[start] = dp[end + 1] + 1;
+                trace[start] = Trace{it->second, static_cast<uint64>(end + 1),
+                                     static_cast<uint64>(start), static_cast<uint64>(end)};
+            }
+        }
+    }
+    return trace;
+}
+
+// Segments of query against one strand only
+template <class Index>
+vector<MatchSegment> segment_one_strand(string_view query, const Index &ref_map, bool reverse) {
+    if (!reverse) return reconstruct_path(find_forward_path(query, ref_map), query.size());
+    const string rc = reverse_dna(string(query));
+    const uint64 n = query.size();
+    vector<MatchSegment> result;
+    const vector<MatchSegment> segments = reconstruct_path(find_forward_path(rc, ref_map), n);
+    for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+        result.push_back({RefSeq{it->ref_info.start, it->ref_info.end, true}, n - 1 - it->query_end, n - 1 - it->query_start});
+    }
+    return result;
+}
+
+// Fast path: long identical stretches between query and reference are emitted
+// directly as segments, only the divergent windows in between go through the DP.
+const size_t MIN_ANCHOR_LEN = 64;
+
+struct Anchor {
+    size_t query_start;
+    size_t ref_start;
+    size_t len;
+    bool reverse = false;
+};
+
+// Length of the common prefix of a and b (at most n), compared a word at a time
+size_t common_prefix_length(const char *a, const char *b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64 x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) break;
+    }
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+// Length of the common suffix of a[0..n) and b[0..n)
+size_t common_suffix_length(const char *a, const char *b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64 x, y;
+        memcpy(&x, a + n - i - 8, 8);
+        memcpy(&y, b + n - i - 8, 8);
+        if (x != y) break;
+    }
+    while (i < n && a[n - i - 1] == b[n - i - 1]) ++i;
+    return i;
+}
+
+// Identical prefix/suffix plus exact runs on the two diagonals they anchor
+// (same offset as the prefix, same offset as the suffix). Runs are linear to find
+// and cover substitutions as well as a single indel between the two ends.
+vector<Anchor> find_identical_anchors(string_view query, const string &ref, size_t min_len) {
+    const size_t query_len = query.size(), ref_len = ref.size();
+    vector<Anchor> candidates;
+
+    size_t prefix = common_prefix_length(query.data(), ref.data(), min(query_len, ref_len));
+    if (prefix < min_len) prefix = 0;
+    else candidates.push_back({0, 0, prefix});
+
+    const size_t rest = min(query_len - prefix, ref_len);
+    size_t suffix = common_suffix_length(query.data() + query_len - rest, ref.data() + ref_len - rest, rest);
+    if (suffix < min_len) suffix = 0;
+    else candidates.push_back({query_len - suffix, ref_len - suffix, suffix});
+
+    const size_t lo = prefix, hi = query_len - suffix;
+    const long long diagonals[] = {0, static_cast<long long>(ref_len) - static_cast<long long>(query_len)};
+    for (size_t d = 0; d < 2 && lo < hi; ++d) {
+        if (d == 1 && diagonals[1] == diagonals[0]) break;
+        const long long delta = diagonals[d];
+        size_t q = lo;
+        if (delta < 0 && q < static_cast<size_t>(-delta)) q = static_cast<size_t>(-delta);
+        while (q < hi) {
+            const size_t r = static_cast<size_t>(static_cast<long long>(q) + delta);
+            if (r >= ref_len) break;
+            const size_t len = common_prefix_length(query.data() + q, ref.data() + r, min(hi - q, ref_len - r));
+            if (len >= min_len) candidates.push_back({q, r, len});
+            q += len + 1;
+        }
+    }
+
+    // Keep the longest non-overlapping runs, in query order
+    sort(candidates.begin(), candidates.end(), [](const Anchor &a, const Anchor &b) { return a.len > b.len; });
+    vector<Anchor> anchors;
+    for (const Anchor &c : candidates) {
+        bool overlaps = false;
+        for (const Anchor &a : anchors) {
+            if (c.query_start < a.query_start + a.len && a.query_start < c.query_start + c.len) {
+                overlaps = true;
+                break;
+            }
+        }
+        if (!overlaps) anchors.push_back(c);
+    }
+    sort(anchors.begin(), anchors.end(), [](const Anchor &a, const Anchor &b) { return a.query_start < b.query_start; });
+    return anchors;
+}
+
+// Pieces of forward anchors that lie inside the regions and are still long enough
+vector<Anchor> clip_anchors_to_regions(const vector<Anchor> &anchors, const vector<RefRegion> &regions,
+                                       size_t min_len) {
+    vector<Anchor> clipped;
+    for (const Anchor &a : anchors) {
+        for (const RefRegion &r : regions) {
+            const uint64 lo = max<uint64>(a.ref_start, r.start), hi = min<uint64>(a.ref_start + a.len - 1, r.end);
+            if (lo > hi || hi - lo + 1 < min_len) continue;
+            clipped.push_back({a.query_start + (lo - a.ref_start), lo, hi - lo + 1, false});
+        }
+    }
+    return clipped;
+}
+
+// Segments the query using identical anchors and runs `align_window` only on the
+// gaps between them. Window segments come back in window coordinates.
+vector<MatchSegment> align_with_fast_path(string_view query, const string &ref, size_t min_anchor_len,
+                                          const vector<RefRegion> &regions,
+                                          const function<vector<MatchSegment>(string_view)> &align_window) {
+    vector<MatchSegment> result;
+    size_t pos = 0;
+    auto fill_gap = [&](size_t gap_end) {
+        if (gap_end <= pos) return;
+        for (MatchSegment seg : align_window(query.substr(pos, gap_end - pos))) {
+            seg.query_start += pos;
+            seg.query_end += pos;
+            result.push_back(seg);
+        }
+    };
+    vector<Anchor> anchors = find_identical_anchors(query, ref, min_anchor_len);
+    if (!regions.empty()) anchors = clip_anchors_to_regions(anchors, regions, min_anchor_len);
+    for (const Anchor &a : anchors) {
+        fill_gap(a.query_start);
+        result.push_back({RefSeq{a.ref_start, a.ref_start + a.len - 1, false},
+                          a.query_start, a.query_start + a.len - 1});
+        pos = a.query_start + a.len;
+    }
+    fill_gap(query.size());
+    return result;
+}
+
+// MUM mode: maximal unique matches between query (both strands) and reference
+// anchor a colinear chain, and only the gaps between anchors are segmented,
+// recursively with shorter MUMs, then by find_optimal_path on a local window.
+const size_t MIN_MUM_LEN = 20;
+const size_t MIN_MUM_LEN_FLOOR = 8;
+const size_t MUM_GAP_DP_LIMIT = 500;
+const size_t MUM_WINDOW_PAD = 200;
+
+int dna_to_code(char dna) {
+    switch(dna) {
+        case 'A': return 1;
+        case 'C': return 2;
+        case 'G': return 3;
+        case 'T': return 4;
+        default:
+            throw runtime_error("Invalid DNA character: '" + string(1, dna) + "'");
+    }
+}
+
+// Suffix array by prefix doubling over cyclic shifts with counting sort.
+// s must end with a unique smallest symbol 0, so shifts order like suffixes.
+vector<int> build_suffix_array(const vector<int> &s, int alphabet) {
+    const int n = s.size();
+    vector<int> p(n), c(n), cnt(max(alphabet, n), 0);
+    for (int x : s) cnt[x]++;
+    for (int i = 1; i < alphabet; ++i) cnt[i] += cnt[i - 1];
+    for (int i = 0; i < n; ++i) p[--cnt[s[i]]] = i;
+    int classes = 1;
+    c[p[0]] = 0;
+    for (int i = 1; i < n; ++i) {
+        if (s[p[i]] != s[p[i - 1]]) classes++;
+        c[p[i]] = classes - 1;
+    }
+    vector<int> pn(n), cn(n);
+    for (int h = 1; h < n && classes < n; h <<= 1) {
+        for (int i = 0; i < n; ++i) pn[i] = p[i] >= h ? p[i] - h : p[i] - h + n;
+        fill(cnt.begin(), cnt.begin() + classes, 0);
+        for (int i = 0; i < n; ++i) cnt[c[pn[i]]]++;
+        for (int i = 1; i < classes; ++i) cnt[i] += cnt[i - 1];
+        for (int i = n - 1; i >= 0; --i) p[--cnt[c[pn[i]]]] = pn[i];
+        cn[p[0]] = 0;
+        classes = 1;
+        for (int i = 1; i < n; ++i) {
+            const int a = p[i], b = p[i - 1];
+            if (c[a] != c[b] || c[(a + h) % n] != c[(b + h) % n]) classes++;
+            cn[p[i]] = classes - 1;
+        }
+        c.swap(cn);
+    }
+    return p;
+}
+
+// Kasai: lcp[i] = longest common prefix of suffixes sa[i] and sa[i + 1]
+vector<int> build_lcp(const vector<int> &s, const vector<int> &sa) {
+    const int n = s.size();
+    vector<int> rank(n), lcp(n, 0);
+    for (int i = 0; i < n; ++i) rank[sa[i]] = i;
+    int k = 0;
+    for (int i = 0; i < n; ++i) {
+        if (rank[i] == n - 1) {
+            k = 0;
+            continue;
+        }
+        const int j = sa[rank[i] + 1];
+        while (i + k < n && j + k < n && s[i + k] == s[j + k]) k++;
+        lcp[rank[i]] = k;
+        if (k > 0) k--;
+    }
+    return lcp;
+}
+
+// Text layout: ref | 5 | query | 6 | reverse_dna(query) | 0. Separators are unique,
+// so matches never cross them and a MUM is unique across both query strands.
+vector<Anchor> find_mums(const string &query, const string &ref, size_t min_len) {
+    const size_t ref_len = ref.size(), query_len = query.size();
+    const string query_rc = reverse_dna(query);
+    vector<int> text;
+    text.reserve(ref_len + 2 * query_len + 3);
+    for (char c : ref) text.push_back(dna_to_code(c));
+    text.push_back(5);
+    for (char c : query) text.push_back(dna_to_code(c));
+    text.push_back(6);
+    for (char c : query_rc) text.push_back(dna_to_code(c));
+    text.push_back(0);
+
+    const vector<int> sa = build_suffix_array(text, 7);
+    const vector<int> lcp = build_lcp(text, sa);
+    const size_t fwd_begin = ref_len + 1, rc_begin = ref_len + query_len + 2;
+    const int n = text.size();
+
+    vector<Anchor> mums;
+    for (int i = 0; i + 1 < n; ++i) {
+        const int len = lcp[i];
+        if (len < static_cast<int>(min_len)) continue;
+        if ((i > 0 && lcp[i - 1] >= len) || (i + 2 < n && lcp[i + 1] >= len)) continue;
+        size_t r = sa[i], q = sa[i + 1];
+        if (r > q) swap(r, q);
+        if (r >= ref_len || q < fwd_begin) continue;
+        if (r > 0 && text[r - 1] == text[q - 1]) continue; // not left-maximal
+        if (q < rc_begin) {
+            mums.push_back({q - fwd_begin, r, static_cast<size_t>(len), false});
+        } else {
+            mums.push_back({query_len - (q - rc_begin) - len, r, static_cast<size_t>(len), true});
+        }
+    }
+    return mums;
+}
+
+// Heaviest chain of same-strand anchors, increasing in query and colinear in
+// reference (increasing for forward, decreasing for reverse complement), by a
+// weighted LIS over a Fenwick tree of prefix maxima. Overlaps are clipped.
+vector<Anchor> chain_colinear_anchors(vector<Anchor> anchors, bool reverse, size_t ref_len) {
+    anchors.erase(remove_if(anchors.begin(), anchors.end(),
+                            [&](const Anchor &a) { return a.reverse != reverse; }), anchors.end());
+    if (anchors.empty()) return anchors;
+    sort(anchors.begin(), anchors.end(), [](const Anchor &a, const Anchor &b) { return a.query_start < b.query_start; });
+
+    const size_t m = anchors.size();
+    auto ref_key = [&](const Anchor &a) { return reverse ? ref_len - a.ref_start : a.ref_start + 1; };
+    vector<pair<uint64, int>> tree(ref_len + 2, {0, -1});
+    vector<uint64> score(m);
+    vector<int> prev(m, -1);
+    for (size_t i = 0; i < m;) {
+        size_t group_end = i;
+        while (group_end < m && anchors[group_end].query_start == anchors[i].query_start) group_end++;
+        for (size_t j = i; j < group_end; ++j) {
+            pair<uint64, int> best{0, -1};
+            for (size_t k = ref_key(anchors[j]) - 1; k > 0; k -= k & -k) best = max(best, tree[k]);
+            score[j] = best.first + anchors[j].len;
+            prev[j] = best.second;
+        }
+        for (size_t j = i; j < group_end; ++j) {
+            for (size_t k = ref_key(anchors[j]); k < tree.size(); k += k & -k) {
+                tree[k] = max(tree[k], make_pair(score[j], static_cast<int>(j)));
+            }
+        }
+        i = group_end;
+    }
+
+    int cur = max_element(score.begin(), score.end()) - score.begin();
+    vector<Anchor> chain;
+    for (; cur >= 0; cur = prev[cur]) chain.push_back(anchors[cur]);
+    std::reverse(chain.begin(), chain.end());
+
+    vector<Anchor> clipped;
+    for (Anchor a : chain) {
+        if (!clipped.empty()) {
+            const Anchor &last = clipped.back();
+            const size_t last_end = last.query_start + last.len;
+            if (a.query_start < last_end) {
+                const size_t d = last_end - a.query_start;
+                if (d >= a.len) continue;
+                a.query_start += d;
+                a.len -= d;
+                if (!a.reverse) a.ref_start += d;
+            }
+        }
+        clipped.push_back(a);
+    }
+    return clipped;
+}
+
+// Forward chain and reverse chain merged, longer anchors first, without query overlap
+vector<Anchor> select_mum_anchors(const vector<Anchor> &mums, size_t ref_len) {
+    vector<Anchor> candidates = chain_colinear_anchors(mums, false, ref_len);
+    for (const Anchor &a : chain_colinear_anchors(mums, true, ref_len)) candidates.push_back(a);
+    sort(candidates.begin(), candidates.end(), [](const Anchor &a, const Anchor &b) { return a.len > b.len; });
+    vector<Anchor> selected;
+    for (const Anchor &c : candidates) {
+        bool overlaps = false;
+        for (const Anchor &a : selected) {
+            if (c.query_start < a.query_start + a.len && a.query_start < c.query_start + c.len) {
+                overlaps = true;
+                break;
+            }
+        }
+        if (!overlaps) selected.push_back(c);
+    }
+    sort(selected.begin(), selected.end(), [](const Anchor &a, const Anchor &b) { return a.query_start < b.query_start; });
+    return selected;
+}
+
+// Segments query against a (small) reference window with the original DP. The
+// window index stops at query-length substrings: W * |query| entries instead of
+// W^2, which for the short gaps between anchors is most of the MUM mode cost.
+vector<MatchSegment> align_in_window(const string &query, const string &ref, size_t ref_offset) {
+    RefMap ref_map(0, new_hash_key());
+    build_reference_hash(ref, ref_map, false, 0, query.size());
+    build_reference_hash(ref, ref_map, true, 0, query.size());
+    auto result = segment_verified(query, ref, ref_map);
+    for (MatchSegment &seg : result) {
+        seg.ref_info.start += ref_offset;
+        seg.ref_info.end += ref_offset;
+    }
+    return result;
+}
+
+vector<MatchSegment> align_by_mums(const string &query, const string &ref, size_t min_len) {
+    const vector<Anchor> anchors = select_mum_anchors(find_mums(query, ref, min_len), ref.size());
+    if (anchors.empty()) {
+        if (min_len > MIN_MUM_LEN_FLOOR) return align_by_mums(query, ref, max(min_len / 2, MIN_MUM_LEN_FLOOR));
+        if (ref.size() > 4 * (MUM_GAP_DP_LIMIT + MUM_WINDOW_PAD)) {
+            throw runtime_error("MUM alignment: no anchors found for a " + to_string(query.size()) + " bp region");
+        }
+        return align_in_window(query, ref, 0);
+    }
+
+    // Reference position adjacent to the gap on each side of an anchor
+    auto ref_before = [](const Anchor &a) { return a.reverse ? a.ref_start + a.len : a.ref_start; };
+    auto ref_after = [](const Anchor &a) { return a.reverse ? a.ref_start : a.ref_start + a.len; };
+
+    vector<MatchSegment> result;
+    size_t pos = 0;
+    auto fill_gap = [&](size_t gap_end, const Anchor *left, const Anchor *right) {
+        if (gap_end <= pos) return;
+        const size_t gap_len = gap_end - pos;
+        size_t lo = left ? ref_after(*left) : ref_before(*right);
+        size_t hi = right ? ref_before(*right) : ref_after(*left);
+        if (lo > hi) swap(lo, hi);
+        if (hi - lo > 2 * gap_len + MUM_WINDOW_PAD) hi = lo = left ? ref_after(*left) : ref_before(*right);
+        lo = lo > gap_len + MUM_WINDOW_PAD ? lo - gap_len - MUM_WINDOW_PAD : 0;
+        hi = min(ref.size(), hi + gap_len + MUM_WINDOW_PAD);
+
+        const string gap = query.substr(pos, gap_len), window = ref.substr(lo, hi - lo);
+        vector<MatchSegment> segments;
+        if (gap_len <= MUM_GAP_DP_LIMIT) {
+            segments = align_in_window(gap, window, lo);
+        } else {
+            segments = align_by_mums(gap, window, max(min_len / 2, MIN_MUM_LEN_FLOOR));
+            for (MatchSegment &seg : segments) {
+                seg.ref_info.start += lo;
+                seg.ref_info.end += lo;
+            }
+        }
+        for (MatchSegment &seg : segments) {
+            seg.query_start += pos;
+            seg.query_end += pos;
+            result.push_back(seg);
+        }
+    };
+    for (size_t i = 0; i < anchors.size(); ++i) {
+        const Anchor &a = anchors[i];
+        fill_gap(a.query_start, i > 0 ? &anchors[i - 1] : nullptr, &a);
+        result.push_back({RefSeq{a.ref_start, a.ref_start + a.len - 1, a.reverse},
+                          a.query_start, a.query_start + a.len - 1});
+        pos = a.query_start + a.len;
+    }
+    fill_gap(query.size(), &anchors.back(), nullptr);
+    return result;
+}
+
 void validate_dna(const string &dna, const string &name) {
     for (char c : dna) {
         if (c != 'A' && c != 'T' && c != 'C' && c != 'G') {
@@ -146,80 +768,4000 @@ void validate_dna(const string &dna, const string &name) {
     }
 }
 
-int main() {
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
+// Incremental engine: keeps the segmentation DP of one query so that an edit
+// only recomputes the positions it can influence. dp is stored as differences
+// delta[i] = dp[i] - dp[i + 1], so a constant cost shift of everything left of
+// an edit leaves the stored state untouched. Start i reads only the substrings
+// up to its failed probe at i + probe_len[i] and the deltas before it, and
+// substrings are prefix-closed, so i + probe_len[i] never decreases with i: the
+// leftward recomputation stops at the first start whose probe ends short of the
+// edit and of every changed delta.
+struct IncrementalState {
+    const RefMap *ref_map;
+    string query;
+    vector<int32_t> delta;
+    vector<uint32_t> seg_len;    // length of the segment chosen at each start
+    vector<RefSeq> choice;
+    vector<uint32_t> probe_len;  // substrings found at each start
+};
 
-    // UI Initialization
-    cout << "\033[1;34m\n======== DNA Sequence Alignment Tool ========\033[0m\n";
-    
-    // Reference sequence input
-    cout << "\n\033[1;32m>>> Step 1/2: Enter Reference Sequence (long)\033[0m\n";
-    cout << "Enter reference sequence (A/T/C/G only): \033[36m" << flush;
-    string ref_seq;
-    if (!getline(cin, ref_seq)) {
-        cerr << "\033[31m\nError: Failed to read input\033[0m\n";
-        return 1;
+// Recomputes the DP at start i from the deltas to its right; returns true if its
+// delta changed (a new segment choice alone does not affect the starts left of it)
+bool update_incremental_position(IncrementalState &st, size_t i) {
+    const size_t n = st.query.size();
+    const uint64 base = st.ref_map->hash_function().base;
+    uint64 hash = 0;
+    int64_t rel = 0, best = numeric_limits<int64_t>::max();  // dp[i + len] - dp[i + 1]
+    uint32_t best_len = 0, found = 0;
+    RefSeq best_ref{};
+    for (size_t len = 1; i + len <= n; ++len) {
+        hash = hash_step(hash, base, st.query[i + len - 1]);
+        const auto it = st.ref_map->find(hash);
+        if (it == st.ref_map->end()) break;  // substrings are prefix-closed
+        found = static_cast<uint32_t>(len);
+        if (len >= 2) rel -= st.delta[i + len - 1];
+        if (rel < best || (rel == best && !it->second.reverse)) {
+            best = rel;
+            best_len = static_cast<uint32_t>(len);
+            best_ref = it->second;
+        }
     }
-    ref_seq = trim(ref_seq);
-    to_upper(ref_seq);
-    if (ref_seq.empty()) {
-        cerr << "\033[31m\nError: Reference sequence cannot be empty\033[0m\n";
-        return 1;
+    if (best_len == 0) throw runtime_error("Alignment break: No match found at position " + to_string(i));
+
+    const int32_t new_delta = static_cast<int32_t>(best + 1);
+    const bool changed = new_delta != st.delta[i];
+    st.delta[i] = new_delta;
+    st.seg_len[i] = best_len;
+    st.choice[i] = best_ref;
+    st.probe_len[i] = found;
+    return changed;
+}
+
+IncrementalState build_incremental_state(const RefMap &ref_map, const string &query) {
+    IncrementalState st{&ref_map, query, vector<int32_t>(query.size(), 0),
+                        vector<uint32_t>(query.size(), 0), vector<RefSeq>(query.size()),
+                        vector<uint32_t>(query.size(), 0)};
+    for (size_t i = query.size(); i-- > 0;) update_incremental_position(st, i);
+    return st;
+}
+
+// Replaces query[pos, pos + erase_len) by insert; returns how many starts were recomputed.
+// Starts right of the edit keep their state (only their index shifts); starts left of it
+// are recomputed only while their probe reaches the edit or a start whose delta changed.
+size_t apply_query_edit(IncrementalState &st, size_t pos, size_t erase_len, const string &insert) {
+    if (pos > st.query.size() || erase_len > st.query.size() - pos) {
+        throw runtime_error("Edit out of range: query length is " + to_string(st.query.size()));
     }
-    cout << "\033[0m"; // Reset color
+    for (char c : insert) {
+        if (st.ref_map->find(hash_step(0, st.ref_map->hash_function().base, c)) == st.ref_map->end()) {
+            throw runtime_error("Edit inserts '" + string(1, c) + "', which never occurs in the reference");
+        }
+    }
+    st.query.replace(pos, erase_len, insert);
+    st.delta.erase(st.delta.begin() + pos, st.delta.begin() + pos + erase_len);
+    st.delta.insert(st.delta.begin() + pos, insert.size(), 0);
+    st.seg_len.erase(st.seg_len.begin() + pos, st.seg_len.begin() + pos + erase_len);
+    st.seg_len.insert(st.seg_len.begin() + pos, insert.size(), 0);
+    st.choice.erase(st.choice.begin() + pos, st.choice.begin() + pos + erase_len);
+    st.choice.insert(st.choice.begin() + pos, insert.size(), RefSeq{});
+    st.probe_len.erase(st.probe_len.begin() + pos, st.probe_len.begin() + pos + erase_len);
+    st.probe_len.insert(st.probe_len.begin() + pos, insert.size(), 0);
 
-    // Query sequence input
-    cout << "\n\033[1;32m>>> Step 2/2: Enter Query Sequence (short)\033[0m\n";
-    cout << "Enter query sequence (A/T/C/G only): \033[36m" << flush;
-    string query_seq;
-    if (!getline(cin, query_seq)) {
-        cerr << "\033[31m\nError: Failed to read input\033[0m\n";
-        return 1;
+    size_t recomputed = 0, frontier = pos;  // leftmost index whose substrings or delta changed
+    for (size_t i = pos + insert.size(); i-- > 0;) {
+        if (i < pos && i + st.probe_len[i] < frontier) break;  // so does every probe further left
+        recomputed++;
+        if (update_incremental_position(st, i)) frontier = i;
     }
-    query_seq = trim(query_seq);
-    to_upper(query_seq);
-    if (query_seq.empty()) {
-        cerr << "\033[31m\nError: Query sequence cannot be empty\033[0m\n";
-        return 1;
+    return recomputed;
+}
+
+vector<MatchSegment> incremental_segments(const IncrementalState &st) {
+    vector<MatchSegment> result;
+    for (size_t pos = 0; pos < st.query.size(); pos += st.seg_len[pos]) {
+        result.push_back({st.choice[pos], pos, pos + st.seg_len[pos] - 1});
     }
-    cout << "\033[0m"; // Reset color
+    return result;
+}
 
-    try {
-        // Validation
-        validate_dna(ref_seq, "Reference sequence");
-        validate_dna(query_seq, "Query sequence");
+struct NamedSequence {
+    string name;
+    string seq;
+    string description;  // rest of the FASTA header line
+};
 
-        // Build hash map
-        unordered_map<uint64, RefSeq> ref_map;
-        build_reference_hash(ref_seq, ref_map, false);
-        build_reference_hash(ref_seq, ref_map, true);
+// FASTA ('>' headers, multi-line records) or one plain sequence per line; each
+// record is validated and handed to fn as soon as it is complete
+void for_each_sequence(const string &path, const function<void(NamedSequence &&)> &fn) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Cannot open " + path);
+    NamedSequence record;
+    size_t count = 0;
+    bool in_record = false;
+    auto emit = [&]() {
+        if (!in_record) return;
+        if (record.seq.empty()) throw runtime_error("Sequence '" + record.name + "' in " + path + " is empty");
+        validate_dna(record.seq, "Sequence '" + record.name + "'");
+        fn(move(record));
+        record = NamedSequence{};
+        in_record = false;
+    };
+    string line;
+    while (getline(in, line)) {
+        line = trim(line);
+        if (line.empty()) continue;
+        if (line[0] == '>') {
+            emit();
+            const string header = trim(line.substr(1));
+            const size_t space = header.find_first_of(" \t");
+            record = {header.substr(0, space), "", space == string::npos ? "" : trim(header.substr(space))};
+            in_record = true;
+            ++count;
+            continue;
+        }
+        to_upper(line);
+        if (in_record) {
+            record.seq += line;
+        } else {
+            record = {"seq" + to_string(++count), line, ""};
+            in_record = true;
+            emit();
+        }
+    }
+    emit();
+}
 
-        // Find optimal path
-        auto trace = find_optimal_path(query_seq, ref_map);
-        auto result = reconstruct_path(trace, query_seq.size());
-
-        // Output results
-        cout << "\n\033[1;34m======== Alignment Results ========\033[0m\n";
-        cout << "Reference length: \033[33m" << ref_seq.size() << " bp\033[0m\n";
-        cout << "Query length: \033[33m" << query_seq.size() << " bp\033[0m\n";
-        cout << "\033[1;36mMatched segments: " << result.size() << "\033[0m\n\n";
-        
-        for (size_t i = 0; i < result.size(); ++i) {
-            const auto& seg = result[i];
-            const string seq = ref_seq.substr(seg.ref_info.start, 
-                                            seg.ref_info.end - seg.ref_info.start + 1);
-            cout << "\033[1;95mSegment " << i + 1 << ":\033[0m\n"
-                 << "  \033[90mRef position:\033[0m [\033[35m" << seg.ref_info.start 
-                 << "\033[0m-\033[35m" << seg.ref_info.end << "\033[0m]\n"
-                 << "  \033[90mQuery position:\033[0m [\033[35m" << seg.query_start 
-                 << "\033[0m-\033[35m" << seg.query_end << "\033[0m]\n"
-                 << "  \033[90mStrand:\033[0m " 
-                 << (seg.ref_info.reverse ? "\033[33mReverse complement\033[0m" : "\033[33mForward\033[0m") << "\n"
-                 << "  \033[90mMatched sequence:\033[0m \033[36m" << seq << "\033[0m\n"
-                 << "  \033[90mLength:\033[0m \033[32m" << seq.size() << " bp\033[0m\n\n";
-        }
-        cout << "\033[1;34m==========================\033[0m\n";
+vector<NamedSequence> read_sequences(const string &path) {
+    vector<NamedSequence> records;
+    for_each_sequence(path, [&](NamedSequence &&r) { records.push_back(move(r)); });
+    return records;
+}
+
+// All-vs-all: every substring (both strands) of every sequence is indexed once,
+// with the set of sequence IDs containing it, so one hash lookup per query
+// substring drives the segmentation DP against all targets simultaneously.
+const size_t ALL_VS_ALL_MIN_SEGMENT = 20;
+
+struct CollectionIndex {
+    size_t num_seqs = 0;
+    size_t words = 0;                       // 64-bit words per membership bitset
+    unordered_map<uint64, uint32_t, SeededHash> slots{0, new_hash_key()};  // substring hash -> bitset slot
+    vector<uint64> members;
+
+    const uint64 *find(uint64 hash) const {
+        const auto it = slots.find(hash);
+        return it == slots.end() ? nullptr : &members[it->second * words];
+    }
+};
+
+CollectionIndex build_collection_index(const vector<NamedSequence> &seqs) {
+    CollectionIndex index;
+    index.num_seqs = seqs.size();
+    index.words = (seqs.size() + 63) / 64;
+    const uint64 base = index.slots.hash_function().base;
+    for (size_t id = 0; id < seqs.size(); ++id) {
+        for (const string &strand : {seqs[id].seq, reverse_dna(seqs[id].seq)}) {
+            const size_t len = strand.size();
+            for (size_t start = 0; start < len; ++start) {
+                uint64 hash = 0;
+                for (size_t end = start; end < len; ++end) {
+                    hash = hash_step(hash, base, strand[end]);
+                    const auto ins = index.slots.try_emplace(hash, static_cast<uint32_t>(index.slots.size()));
+                    if (ins.second) index.members.resize(index.members.size() + index.words, 0);
+                    index.members[ins.first->second * index.words + id / 64] |= 1ULL << (id % 64);
+                }
+            }
+        }
+    }
+    return index;
+}
+
+struct PairStats {
+    uint64 segments;  // 0 when the query cannot be segmented against the target
+    double coverage;  // fraction of query bases in segments >= ALL_VS_ALL_MIN_SEGMENT
+};
+
+// Segments seqs[query_id] against every other sequence in one pass over its substrings;
+// nullopt when a chosen segment does not occur in its target (a hash collision)
+optional<vector<PairStats>> segment_against_collection(const vector<NamedSequence> &seqs, const CollectionIndex &index,
+                                             size_t query_id) {
+    const string &query = seqs[query_id].seq;
+    const size_t n = query.size(), targets = seqs.size();
+    const uint32_t INF = numeric_limits<uint32_t>::max() - 1;
+    const uint64 base = index.slots.hash_function().base;
+    vector<uint32_t> dp(targets * (n + 1), INF), next(targets * (n + 1), 0);
+    for (size_t t = 0; t < targets; ++t) dp[t * (n + 1) + n] = 0;
+
+    for (size_t start = n; start-- > 0;) {
+        uint64 hash = 0;
+        for (size_t end = start; end < n; ++end) {
+            hash = hash_step(hash, base, query[end]);
+            const uint64 *bits = index.find(hash);
+            if (!bits) continue;
+            for (size_t w = 0; w < index.words; ++w) {
+                for (uint64 m = bits[w]; m; m &= m - 1) {
+                    const size_t t = w * 64 + __builtin_ctzll(m);
+                    const uint32_t cost = dp[t * (n + 1) + end + 1] + 1;
+                    if (cost < dp[t * (n + 1) + start]) {
+                        dp[t * (n + 1) + start] = cost;
+                        next[t * (n + 1) + start] = end + 1;
+                    }
+                }
+            }
+        }
+    }
+
+    vector<PairStats> stats(targets, PairStats{0, 0.0});
+    for (size_t t = 0; t < targets; ++t) {
+        if (t == query_id || dp[t * (n + 1)] >= INF) continue;
+        const string &target = seqs[t].seq;
+        size_t covered = 0;
+        for (size_t pos = 0; pos < n; pos = next[t * (n + 1) + pos]) {
+            const size_t len = next[t * (n + 1) + pos] - pos;
+            const string piece = query.substr(pos, len);
+            if (target.find(piece) == string::npos && target.find(reverse_dna(piece)) == string::npos) return nullopt;
+            if (len >= ALL_VS_ALL_MIN_SEGMENT) covered += len;
+        }
+        stats[t] = {dp[t * (n + 1)], static_cast<double>(covered) / n};
+    }
+    stats[query_id] = {1, 1.0};
+    return stats;
+}
+
+// Rows are computed in parallel; the distance 1 - mean(coverage both ways) is written
+// as a PHYLIP square matrix, segment counts and coverages as a table on stdout.
+void run_all_vs_all(const string &path, const string &matrix_path, unsigned threads) {
+    const vector<NamedSequence> seqs = read_sequences(path);
+    if (seqs.size() < 2) throw runtime_error("All-vs-all needs at least two sequences in " + path);
+    CollectionIndex index = build_collection_index(seqs);
+
+    // rows that fail verification are recomputed against an index under a new key
+    vector<vector<PairStats>> stats(seqs.size());
+    vector<char> verified(seqs.size(), 0);
+    for (int attempt = 1;; ++attempt) {
+        atomic<size_t> next_row{0};
+        auto worker = [&]() {
+            for (size_t row; (row = next_row++) < seqs.size();) {
+                if (verified[row]) continue;
+                auto row_stats = segment_against_collection(seqs, index, row);
+                if (!row_stats) continue;
+                stats[row] = move(*row_stats);
+                verified[row] = 1;
+            }
+        };
+        vector<thread> pool;
+        for (unsigned i = 0; i < max(1u, threads); ++i) pool.emplace_back(worker);
+        for (thread &t : pool) t.join();
+        if (count(verified.begin(), verified.end(), 0) == 0) break;
+        if (attempt == HASH_VERIFY_ATTEMPTS) {
+            throw runtime_error("Segment verification failed after " + to_string(attempt) + " hash keys");
+        }
+        index = build_collection_index(seqs);
+    }
+
+    cout << "query\ttarget\tsegments\tcoverage\n";
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        for (size_t j = 0; j < seqs.size(); ++j) {
+            if (i == j) continue;
+            cout << seqs[i].name << '\t' << seqs[j].name << '\t';
+            if (stats[i][j].segments) cout << stats[i][j].segments;
+            else cout << '-';
+            cout << '\t' << fixed << setprecision(4) << stats[i][j].coverage << '\n';
+        }
+    }
+
+    ofstream file;
+    if (!matrix_path.empty()) {
+        file.open(matrix_path);
+        if (!file) throw runtime_error("Cannot write " + matrix_path);
+    }
+    ostream &out = matrix_path.empty() ? cout : file;
+    out << seqs.size() << '\n';
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        out << seqs[i].name;
+        for (size_t j = 0; j < seqs.size(); ++j) {
+            const double dist = i == j ? 0.0 : 1.0 - (stats[i][j].coverage + stats[j][i].coverage) / 2;
+            out << ' ' << fixed << setprecision(6) << dist;
+        }
+        out << '\n';
+    }
+}
+
+// k-mer spectrum: canonical k-mers of the 2-bit packed reference are counted in
+// two lock-free passes. Each thread scatters the k-mers of its chunk into its own
+// per-partition buckets; then each partition is sorted and run-length counted by
+// one thread. The spectrum (how many distinct k-mers occur c times) picks the
+// minimum MUM length and is printed by --kmer-spectrum.
+const unsigned KMER_PARTITIONS = 64;
+const unsigned MAX_SPECTRUM_K = 32;
+const size_t SPECTRUM_MAX_COUNT = 10000;  // last histogram bucket collects >= this
+const double UNIQUE_KMER_FRACTION = 0.99;
+
+struct PackedDna {
+    vector<uint64> words;
+    size_t len = 0;
+
+    unsigned base(size_t i) const { return (words[i / 32] >> (2 * (i % 32))) & 3; }
+};
+
+// A=0, C=1, G=2, T=3, so the complement of x is 3 - x
+PackedDna pack_dna(const string &dna) {
+    PackedDna packed;
+    packed.len = dna.size();
+    packed.words.assign((dna.size() + 31) / 32, 0);
+    for (size_t i = 0; i < dna.size(); ++i) {
+        packed.words[i / 32] |= static_cast<uint64>(dna_to_code(dna[i]) - 1) << (2 * (i % 32));
+    }
+    return packed;
+}
+
+struct KmerSpectrum {
+    unsigned k = 0;
+    uint64 total = 0;              // k-mer occurrences
+    uint64 distinct = 0;
+    vector<uint64> histogram;      // histogram[c] = distinct k-mers seen c times
+
+    double singleton_fraction() const { return total ? static_cast<double>(histogram[1]) / total : 0.0; }
+};
+
+KmerSpectrum count_kmer_spectrum(const PackedDna &dna, unsigned k, unsigned threads) {
+    if (k == 0 || k > MAX_SPECTRUM_K) throw runtime_error("k must be between 1 and " + to_string(MAX_SPECTRUM_K));
+    KmerSpectrum spectrum;
+    spectrum.k = k;
+    spectrum.histogram.assign(SPECTRUM_MAX_COUNT + 1, 0);
+    if (dna.len < k) return spectrum;
+
+    threads = max(1u, threads);
+    const size_t kmers = dna.len - k + 1, chunk = (kmers + threads - 1) / threads;
+    const uint64 mask = k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+    vector<vector<vector<uint64>>> buckets(threads, vector<vector<uint64>>(KMER_PARTITIONS));
+
+    auto scatter = [&](unsigned t) {
+        const size_t begin = t * chunk, end = min(kmers, begin + chunk);
+        uint64 fwd = 0, rev = 0;
+        for (size_t i = begin; i < end + k - 1 && begin < end; ++i) {
+            const unsigned b = dna.base(i);
+            fwd = ((fwd << 2) | b) & mask;
+            rev = (rev >> 2) | (static_cast<uint64>(3 - b) << (2 * (k - 1)));
+            if (i + 1 < begin + k) continue;
+            const uint64 canon = min(fwd, rev);
+            buckets[t][splitmix64(canon) % KMER_PARTITIONS].push_back(canon);
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back(scatter, t);
+    for (thread &th : pool) th.join();
+    pool.clear();
+
+    vector<vector<uint64>> partial(threads, vector<uint64>(SPECTRUM_MAX_COUNT + 1, 0));
+    vector<uint64> distinct(threads, 0);
+    atomic<unsigned> next_partition{0};
+    auto count = [&](unsigned t) {
+        vector<uint64> keys;
+        for (unsigned p; (p = next_partition++) < KMER_PARTITIONS;) {
+            keys.clear();
+            for (unsigned s = 0; s < threads; ++s) keys.insert(keys.end(), buckets[s][p].begin(), buckets[s][p].end());
+            sort(keys.begin(), keys.end());
+            for (size_t i = 0; i < keys.size();) {
+                size_t j = i + 1;
+                while (j < keys.size() && keys[j] == keys[i]) j++;
+                partial[t][min(j - i, SPECTRUM_MAX_COUNT)]++;
+                distinct[t]++;
+                i = j;
+            }
+        }
+    };
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back(count, t);
+    for (thread &th : pool) th.join();
+
+    spectrum.total = kmers;
+    for (unsigned t = 0; t < threads; ++t) {
+        spectrum.distinct += distinct[t];
+        for (size_t c = 0; c <= SPECTRUM_MAX_COUNT; ++c) spectrum.histogram[c] += partial[t][c];
+    }
+    return spectrum;
+}
+
+// Smallest k at which UNIQUE_KMER_FRACTION of the reference's k-mers are unique
+// on both strands; below it, exact matches of that length are mostly repeats
+KmerSpectrum select_unique_kmer_spectrum(const PackedDna &dna, unsigned threads) {
+    KmerSpectrum spectrum;
+    for (unsigned k = 8; k <= MAX_SPECTRUM_K; ++k) {
+        spectrum = count_kmer_spectrum(dna, k, threads);
+        if (spectrum.singleton_fraction() >= UNIQUE_KMER_FRACTION) break;
+    }
+    return spectrum;
+}
+
+size_t select_mum_length(const string &ref, unsigned threads) {
+    return max<size_t>(MIN_MUM_LEN, select_unique_kmer_spectrum(pack_dna(ref), threads).k);
+}
+
+void run_kmer_spectrum(const string &path, unsigned k, unsigned threads) {
+    const vector<NamedSequence> seqs = read_sequences(path);
+    if (seqs.empty()) throw runtime_error("No sequence in " + path);
+    const PackedDna packed = pack_dna(seqs[0].seq);
+    const KmerSpectrum spectrum = k ? count_kmer_spectrum(packed, k, threads)
+                                    : select_unique_kmer_spectrum(packed, threads);
+    cout << "# k=" << spectrum.k << " total=" << spectrum.total << " distinct=" << spectrum.distinct
+         << " unique=" << fixed << setprecision(4) << spectrum.singleton_fraction() << '\n';
+    if (!k) cout << "# minimum MUM length: " << max<size_t>(MIN_MUM_LEN, spectrum.k) << '\n';
+    cout << "occurrences\tkmers\n";
+    for (size_t c = 1; c <= SPECTRUM_MAX_COUNT; ++c) {
+        if (spectrum.histogram[c]) cout << c << (c == SPECTRUM_MAX_COUNT ? "+" : "") << '\t' << spectrum.histogram[c] << '\n';
+    }
+}
+
+// Elias-Fano coding of a sorted list below `universe`: each value keeps its
+// low_bits low bits verbatim, and its high part is written in unary into a bit
+// vector (value i sets bit high_i + i, so the zeros before it count its high
+// part). About 2 + log2(universe / n) bits per value. Every EF_SELECT_SAMPLE-th
+// set and clear bit is sampled, so access and next_geq scan a few words.
+const size_t EF_SELECT_SAMPLE = 256;
+
+struct EliasFano {
+    size_t count = 0;
+    uint64 universe = 0;
+    unsigned low_bits = 0;
+    vector<uint64> low;
+    vector<uint64> high;
+    vector<uint32_t> one_samples;   // position of set bit j * EF_SELECT_SAMPLE
+    vector<uint32_t> zero_samples;  // position of clear bit j * EF_SELECT_SAMPLE
+
+    size_t size() const { return count; }
+    size_t bytes() const {
+        return (low.size() + high.size()) * sizeof(uint64) + (one_samples.size() + zero_samples.size()) * sizeof(uint32_t);
+    }
+
+    // Position in high of the rank-th (0-based) set or clear bit
+    size_t select(size_t rank, bool zeros) const {
+        size_t pos = (zeros ? zero_samples : one_samples)[rank / EF_SELECT_SAMPLE];
+        size_t left = rank % EF_SELECT_SAMPLE, w = pos / 64;
+        uint64 word = (zeros ? ~high[w] : high[w]) & (~0ULL << (pos % 64));
+        for (size_t c; left >= (c = __builtin_popcountll(word));) {
+            left -= c;
+            word = zeros ? ~high[++w] : high[++w];
+        }
+        for (; left; --left) word &= word - 1;
+        return w * 64 + __builtin_ctzll(word);
+    }
+
+    uint64 operator[](size_t i) const {
+        uint64 value = static_cast<uint64>(select(i, false) - i) << low_bits;
+        if (low_bits) {
+            const size_t bit = i * low_bits;
+            uint64 bits = low[bit / 64] >> (bit % 64);
+            if (bit % 64 + low_bits > 64) bits |= low[bit / 64 + 1] << (64 - bit % 64);
+            value |= bits & ((1ULL << low_bits) - 1);
+        }
+        return value;
+    }
+
+    // Index of the first value >= x, or size()
+    size_t next_geq(uint64 x) const {
+        if (x >= universe) return count;
+        const uint64 h = x >> low_bits;
+        size_t i = h ? select(h - 1, true) + 1 - h : 0;  // values with a high part below h come first
+        while (i < count && (*this)[i] < x) ++i;
+        return i;
+    }
+};
+
+EliasFano encode_elias_fano(const uint32_t *values, size_t n, uint64 universe) {
+    EliasFano ef;
+    ef.count = n;
+    ef.universe = universe;
+    while (n && (universe >> (ef.low_bits + 1)) >= n) ++ef.low_bits;
+    ef.low.assign((n * ef.low_bits + 63) / 64 + 1, 0);
+    const size_t high_len = n + (universe >> ef.low_bits) + 1;
+    ef.high.assign(high_len / 64 + 2, 0);
+    for (size_t i = 0; i < n; ++i) {
+        if (ef.low_bits) {
+            const uint64 low = values[i] & ((1ULL << ef.low_bits) - 1);
+            const size_t bit = i * ef.low_bits;
+            ef.low[bit / 64] |= low << (bit % 64);
+            if (bit % 64 + ef.low_bits > 64) ef.low[bit / 64 + 1] |= low >> (64 - bit % 64);
+        }
+        const size_t pos = (values[i] >> ef.low_bits) + i;
+        ef.high[pos / 64] |= 1ULL << (pos % 64);
+    }
+    for (size_t pos = 0, ones = 0, zeros = 0; pos < high_len; ++pos) {
+        if (ef.high[pos / 64] >> (pos % 64) & 1) {
+            if (ones++ % EF_SELECT_SAMPLE == 0) ef.one_samples.push_back(pos);
+        } else if (zeros++ % EF_SELECT_SAMPLE == 0) {
+            ef.zero_samples.push_back(pos);
+        }
+    }
+    return ef;
+}
+
+// Direct-addressed k-mer table for small k: the 2-bit packed k-mer indexes an
+// offsets array of 4^k + 1 entries, and positions[offsets[x], offsets[x + 1])
+// lists the occurrences of x in ascending order (compressed sparse rows).
+// Built by a parallel counting sort: count, prefix sum, scatter. Rows of at
+// least EF_MIN_POSTINGS occurrences (repeats) move to Elias-Fano lists and keep
+// a single tagged entry naming their list.
+const unsigned DIRECT_KMER_MAX_K = 13;         // 4^13 + 1 offsets = 256 MiB
+const size_t DIRECT_KMER_ROWS_PER_BASE = 1024;  // larger tables cost more to clear than hashing saves
+const size_t EF_MIN_POSTINGS = 64;
+const uint32_t POSTINGS_COMPRESSED = 1u << 31;
+
+// Occurrences of one k-mer, plain or Elias-Fano coded
+struct PostingList {
+    const uint32_t *plain = nullptr;
+    size_t plain_count = 0;
+    const EliasFano *coded = nullptr;
+
+    size_t size() const { return coded ? coded->size() : plain_count; }
+    uint64 operator[](size_t i) const { return coded ? (*coded)[i] : plain[i]; }
+    // first index at or after reference position x, for region-restricted and colinear lookups
+    size_t next_geq(uint64 x) const { return coded ? coded->next_geq(x) : lower_bound(plain, plain + plain_count, x) - plain; }
+};
+
+struct DirectKmerIndex {
+    unsigned k = 0;
+    vector<uint32_t> offsets;
+    vector<uint32_t> positions;
+    vector<EliasFano> repeats;
+
+    PostingList find(uint64 kmer) const {
+        const uint32_t *row = positions.data() + offsets[kmer];
+        const size_t n = offsets[kmer + 1] - offsets[kmer];
+        if (n == 1 && (*row & POSTINGS_COMPRESSED)) return {nullptr, 0, &repeats[*row & ~POSTINGS_COMPRESSED]};
+        return {row, n, nullptr};
+    }
+};
+
+DirectKmerIndex build_direct_kmer_index(const string &genome, unsigned k, unsigned threads) {
+    if (k == 0 || k > DIRECT_KMER_MAX_K) throw runtime_error("Direct k-mer index needs k <= " + to_string(DIRECT_KMER_MAX_K));
+    if (genome.size() >= POSTINGS_COMPRESSED) throw runtime_error("Reference too long for the direct k-mer index");
+    DirectKmerIndex index;
+    index.k = k;
+    const size_t table = size_t(1) << (2 * k);
+    index.offsets.assign(table + 1, 0);
+    if (genome.size() < k) return index;
+
+    threads = max(1u, threads);
+    const size_t kmers = genome.size() - k + 1, chunk = (kmers + threads - 1) / threads;
+    const uint64 mask = table - 1;
+    unique_ptr<atomic<uint32_t>[]> cursor(new atomic<uint32_t>[table]());
+    // Calls fn(kmer, position) for the k-mers starting in thread t's chunk
+    auto for_chunk = [&](unsigned t, auto &&fn) {
+        const size_t begin = t * chunk, end = min(kmers, begin + chunk);
+        uint64 kmer = 0;
+        for (size_t i = begin; i < end + k - 1 && begin < end; ++i) {
+            kmer = ((kmer << 2) | (dna_to_code(genome[i]) - 1)) & mask;
+            if (i + 1 >= begin + k) fn(kmer, static_cast<uint32_t>(i + 1 - k));
+        }
+    };
+    auto run = [&](auto &&pass) {
+        vector<thread> pool;
+        for (unsigned t = 0; t < threads; ++t) pool.emplace_back(pass, t);
+        for (thread &th : pool) th.join();
+    };
+
+    run([&](unsigned t) { for_chunk(t, [&](uint64 x, uint32_t) { cursor[x].fetch_add(1, memory_order_relaxed); }); });
+    for (size_t x = 0; x < table; ++x) {
+        index.offsets[x + 1] = index.offsets[x] + cursor[x].load(memory_order_relaxed);
+        cursor[x].store(index.offsets[x], memory_order_relaxed);
+    }
+    index.positions.resize(kmers);
+    run([&](unsigned t) {
+        for_chunk(t, [&](uint64 x, uint32_t pos) { index.positions[cursor[x].fetch_add(1, memory_order_relaxed)] = pos; });
+    });
+    // chunks race within a row; a row filled by one chunk is already ascending, so
+    // only rows interleaving several chunks fail the linear check and get sorted
+    if (threads > 1) {
+        run([&](unsigned t) {
+            const size_t rows = (table + threads - 1) / threads;
+            for (size_t x = t * rows; x < min(table, (t + 1) * rows); ++x) {
+                const auto begin = index.positions.begin() + index.offsets[x], end = index.positions.begin() + index.offsets[x + 1];
+                if (!is_sorted(begin, end)) sort(begin, end);
+            }
+        });
+    }
+    // compact in place: a row never grows, so writes stay behind reads
+    uint32_t written = 0;
+    for (size_t x = 0; x < table; ++x) {
+        const uint32_t begin = index.offsets[x], end = index.offsets[x + 1];
+        index.offsets[x] = written;
+        if (end - begin >= EF_MIN_POSTINGS) {
+            index.repeats.push_back(encode_elias_fano(&index.positions[begin], end - begin, genome.size()));
+            index.positions[written++] = POSTINGS_COMPRESSED | static_cast<uint32_t>(index.repeats.size() - 1);
+        } else {
+            for (uint32_t i = begin; i < end; ++i) index.positions[written++] = index.positions[i];
+        }
+    }
+    index.offsets[table] = written;
+    index.positions.resize(written);
+    index.positions.shrink_to_fit();
+    return index;
+}
+
+// Unique k-mer index: every k-mer of the reference that occurs once, with its
+// position. Runs of consecutive hits are exact matches on either strand.
+// Small k on a reference long enough to fill it use the direct-addressed table
+// instead of hashing. With regions, only k-mers lying inside one region count:
+// the hash index is built from the regions alone, while the direct table keeps
+// every occurrence and skips between regions with next_geq.
+const uint32_t KMER_REPEATED = numeric_limits<uint32_t>::max();
+
+struct UniqueKmerIndex {
+    unsigned k = 0;
+    unordered_map<uint64, uint32_t, SeededHash> positions{0, new_hash_key()};  // k-mer -> position or KMER_REPEATED
+    DirectKmerIndex direct;  // used instead when k <= DIRECT_KMER_MAX_K
+    vector<RefRegion> regions;  // normalized; empty for the whole reference
+
+    // Position of a k-mer that occurs exactly once, else KMER_REPEATED
+    uint32_t unique_position(uint64 kmer) const {
+        if (direct.k) {
+            const PostingList hits = direct.find(kmer);
+            if (!regions.empty()) return unique_in_regions(hits);
+            return hits.size() == 1 ? static_cast<uint32_t>(hits[0]) : KMER_REPEATED;
+        }
+        const auto it = positions.find(kmer);
+        return it == positions.end() ? KMER_REPEATED : it->second;
+    }
+
+    uint32_t unique_in_regions(const PostingList &hits) const {
+        uint32_t found = KMER_REPEATED;
+        for (size_t i = hits.next_geq(regions.front().start); i < hits.size();) {
+            const uint64 p = hits[i];
+            // first region that could hold the k-mer at p or a later one
+            const auto r = lower_bound(regions.begin(), regions.end(), p + k - 1,
+                                       [](const RefRegion &a, uint64 end) { return a.end < end; });
+            if (r == regions.end()) break;
+            if (r->start > p) {
+                i = hits.next_geq(r->start);
+                continue;
+            }
+            if (found != KMER_REPEATED) return KMER_REPEATED;
+            found = static_cast<uint32_t>(p);
+            ++i;
+        }
+        return found;
+    }
+};
+
+UniqueKmerIndex build_unique_kmer_index(const string &genome, unsigned k, unsigned threads,
+                                        const vector<RefRegion> &regions = {}) {
+    UniqueKmerIndex index;
+    index.k = k;
+    index.regions = regions;
+    if (k <= DIRECT_KMER_MAX_K && (size_t(1) << (2 * k)) <= DIRECT_KMER_ROWS_PER_BASE * genome.size()) {
+        index.direct = build_direct_kmer_index(genome, k, threads);
+        return index;
+    }
+    index.positions.reserve(genome.size());
+    const uint64 mask = k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+    auto add = [&](size_t begin, size_t end) {  // k-mers inside [begin, end)
+        uint64 kmer = 0;
+        for (size_t i = begin; i < end; ++i) {
+            kmer = ((kmer << 2) | (dna_to_code(genome[i]) - 1)) & mask;
+            if (i + 1 < begin + k) continue;
+            const auto ins = index.positions.try_emplace(kmer, static_cast<uint32_t>(i + 1 - k));
+            if (!ins.second) ins.first->second = KMER_REPEATED;
+        }
+    };
+    if (regions.empty()) add(0, genome.size());
+    for (const RefRegion &r : regions) add(r.start, r.end + 1);
+    return index;
+}
+
+
+// Runs of consecutive k-mer hits in seq; query coordinates are shifted by offset.
+// Forward hits share r - q, reverse-complement hits share r + q.
+vector<MatchSegment> find_kmer_runs(const UniqueKmerIndex &index, const string &seq, uint64 offset) {
+    const unsigned k = index.k;
+    const uint64 mask = k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1;
+    vector<MatchSegment> runs;
+    uint64 fwd = 0, rev = 0;
+    size_t valid = 0;
+    for (size_t i = 0; i < seq.size(); ++i) {
+        int code = 0;
+        switch (seq[i]) {
+            case 'A': code = 0; break;
+            case 'C': code = 1; break;
+            case 'G': code = 2; break;
+            case 'T': code = 3; break;
+            default: valid = 0; continue;  // N and other symbols break k-mers
+        }
+        fwd = ((fwd << 2) | code) & mask;
+        rev = (rev >> 2) | (static_cast<uint64>(3 - code) << (2 * (k - 1)));
+        if (++valid < k) continue;
+        const uint64 q = offset + i + 1 - k;
+        for (const bool reverse : {false, true}) {
+            const uint32_t hit = index.unique_position(reverse ? rev : fwd);
+            if (hit == KMER_REPEATED) continue;
+            const uint64 r = hit;
+            MatchSegment *last = nullptr;
+            for (size_t j = runs.size(); j-- > 0 && runs.size() - j <= 2;) {
+                if (runs[j].ref_info.reverse == reverse) {
+                    last = &runs[j];
+                    break;
+                }
+            }
+            // extend when the hit continues the run's diagonal within k bases
+            if (last && q <= last->query_end + 1 && q + k - 1 > last->query_end &&
+                (reverse ? last->ref_info.start + last->query_end == r + k - 1 + q
+                         : last->ref_info.end + q == r + last->query_end)) {
+                const uint64 grow = q + k - 1 - last->query_end;
+                last->query_end += grow;
+                if (reverse) last->ref_info.start -= grow;
+                else last->ref_info.end += grow;
+                continue;
+            }
+            runs.push_back({RefSeq{r, r + k - 1, reverse}, q, q + k - 1});
+        }
+    }
+    return runs;
+}
+
+// Spliced alignment for RNA reads: exact runs of unique k-mer hits are chained
+// colinearly on the forward reference (the reverse-complemented read covers the
+// other strand). Between consecutive segments the reference may jump forward by
+// an intron for SPLICE_PENALTY, reduced when the intron has a canonical GT-AG
+// (or antisense CT-AC) motif; short jumps cost their gap bases like mismatches.
+// Predecessors live in range-max trees over their (rank-compressed) reference
+// end, so each chain step is a logarithmic query over the window of allowed
+// donor positions.
+const unsigned MIN_SPLICED_K = 12;
+const uint64 MIN_INTRON_LEN = 20;
+const uint64 MAX_INTRON_LEN = 500000;
+const long long SPLICE_PENALTY = 20;
+const long long CANONICAL_SPLICE_BONUS = 12;
+const size_t MAX_JUNCTION_SHIFT = 8;  // bases a segment end may give up to place its junction
+
+struct RangeMax {
+    size_t n;
+    vector<pair<long long, uint32_t>> tree;  // (value, entry id)
+    explicit RangeMax(size_t size) : n(max<size_t>(1, size)), tree(2 * n, {numeric_limits<long long>::min(), 0}) {}
+    void raise(size_t pos, long long value, uint32_t id) {
+        for (pos += n; pos; pos >>= 1) {
+            if (value > tree[pos].first) tree[pos] = {value, id};
+        }
+    }
+    // max over positions [lo, hi]
+    pair<long long, uint32_t> query(size_t lo, size_t hi) const {
+        pair<long long, uint32_t> best = {numeric_limits<long long>::min(), 0};
+        for (lo += n, hi += n + 1; lo < hi; lo >>= 1, hi >>= 1) {
+            if (lo & 1) best = max(best, tree[lo++]);
+            if (hi & 1) best = max(best, tree[--hi]);
+        }
+        return best;
+    }
+};
+
+// Best chain of forward runs (query coordinates of query), with its score
+vector<MatchSegment> chain_spliced_segments(const vector<MatchSegment> &runs, const string &ref, long long &score) {
+    struct Node { uint64 qs, qe, rs, re; long long dp; int64_t pred; };
+    struct Entry { uint32_t node; uint64 trim; };
+    vector<Node> nodes;
+    for (const MatchSegment &run : runs) {
+        const uint64 len = run.query_end - run.query_start + 1;
+        for (uint64 u = 0; u <= MAX_JUNCTION_SHIFT && u < len; ++u) {
+            nodes.push_back({run.query_start + u, run.query_end, run.ref_info.start + u, run.ref_info.end, 0, -1});
+        }
+    }
+    sort(nodes.begin(), nodes.end(), [](const Node &a, const Node &b) { return a.qs < b.qs; });
+    vector<Entry> entries;
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        for (uint64 t = 0; t <= MAX_JUNCTION_SHIFT && t <= nodes[i].qe - nodes[i].qs; ++t) entries.push_back({i, t});
+    }
+    // an entry becomes a predecessor once the sweep passes its (trimmed) query end
+    sort(entries.begin(), entries.end(), [&](const Entry &a, const Entry &b) {
+        return nodes[a.node].qe - a.trim < nodes[b.node].qe - b.trim;
+    });
+    auto motif = [&](uint64 pos) { return pos + 1 < ref.size() ? ref.substr(pos, 2) : string(); };
+
+    // trees are indexed by rank among the predecessors' reference ends, not by position
+    vector<uint64> ends;
+    for (const Entry &e : entries) ends.push_back(nodes[e.node].re - e.trim);
+    sort(ends.begin(), ends.end());
+    ends.erase(unique(ends.begin(), ends.end()), ends.end());
+    auto rank = [&](uint64 pos) { return static_cast<size_t>(lower_bound(ends.begin(), ends.end(), pos) - ends.begin()); };
+    // best over predecessors ending in [lo, hi]
+    auto window = [&](const RangeMax &tree, uint64 lo, uint64 hi) {
+        const size_t a = rank(lo), b = rank(hi + 1);
+        return a < b ? tree.query(a, b - 1) : make_pair(numeric_limits<long long>::min(), uint32_t(0));
+    };
+
+    RangeMax near(ends.size()), splice(ends.size()), splice_gt(ends.size()), splice_ct(ends.size());
+    size_t inserted = 0;
+    for (Node &node : nodes) {
+        for (; inserted < entries.size(); ++inserted) {
+            const Entry &e = entries[inserted];
+            const Node &p = nodes[e.node];
+            if (p.qe - e.trim >= node.qs) break;
+            const uint64 r_end = p.re - e.trim;
+            const long long dp = p.dp - static_cast<long long>(e.trim);
+            const size_t slot = rank(r_end);
+            near.raise(slot, dp + static_cast<long long>(p.qe - e.trim + r_end), inserted);
+            splice.raise(slot, dp, inserted);
+            const string donor = motif(r_end + 1);
+            if (donor == "GT") splice_gt.raise(slot, dp, inserted);
+            if (donor == "CT") splice_ct.raise(slot, dp, inserted);
+        }
+        long long best = 0;
+        auto consider = [&](const pair<long long, uint32_t> &cand, long long adjust) {
+            if (cand.first == numeric_limits<long long>::min() || cand.first + adjust <= best) return;
+            best = cand.first + adjust;
+            node.pred = cand.second;
+        };
+        if (node.rs > 0) {
+            // gap bases on either sequence cost one each: dp - g - h
+            const uint64 lo = node.rs > MIN_INTRON_LEN ? node.rs - MIN_INTRON_LEN : 0;
+            consider(window(near, lo, node.rs - 1), 2 - static_cast<long long>(node.rs + node.qs));
+        }
+        if (node.rs >= MIN_INTRON_LEN + 1) {
+            const uint64 hi = node.rs - MIN_INTRON_LEN - 1;
+            const uint64 lo = node.rs > MAX_INTRON_LEN + 1 ? node.rs - MAX_INTRON_LEN - 1 : 0;
+            consider(window(splice, lo, hi), -SPLICE_PENALTY);
+            const string acceptor = motif(node.rs - 2);
+            if (acceptor == "AG") consider(window(splice_gt, lo, hi), CANONICAL_SPLICE_BONUS - SPLICE_PENALTY);
+            if (acceptor == "AC") consider(window(splice_ct, lo, hi), CANONICAL_SPLICE_BONUS - SPLICE_PENALTY);
+        }
+        if (best == 0) node.pred = -1;
+        node.dp = static_cast<long long>(node.qe - node.qs + 1) + best;
+    }
+
+    score = 0;
+    vector<MatchSegment> chain;
+    if (nodes.empty()) return chain;
+    size_t cur = max_element(nodes.begin(), nodes.end(), [](const Node &a, const Node &b) { return a.dp < b.dp; }) - nodes.begin();
+    score = nodes[cur].dp;
+    for (uint64 trim = 0;;) {
+        const Node &n = nodes[cur];
+        chain.push_back({RefSeq{n.rs, n.re - trim, false}, n.qs, n.qe - trim});
+        if (n.pred < 0) break;
+        cur = entries[n.pred].node;
+        trim = entries[n.pred].trim;
+    }
+    reverse(chain.begin(), chain.end());
+    return chain;
+}
+
+struct SpliceJunction {
+    uint64 donor;     // first intron base
+    uint64 acceptor;  // last intron base
+    string motif;
+};
+
+// Reference jumps of at least MIN_INTRON_LEN between consecutive segments
+vector<SpliceJunction> splice_junctions(const string &ref, const vector<MatchSegment> &segments) {
+    vector<SpliceJunction> junctions;
+    for (size_t i = 0; i + 1 < segments.size(); ++i) {
+        const RefSeq &a = segments[i].ref_info, &b = segments[i + 1].ref_info;
+        const uint64 donor = a.reverse ? b.end + 1 : a.end + 1;
+        const uint64 next = a.reverse ? a.start : b.start;
+        if (next < donor + MIN_INTRON_LEN) continue;
+        junctions.push_back({donor, next - 1, ref.substr(donor, 2) + "-" + ref.substr(next - 2, 2)});
+    }
+    return junctions;
+}
+
+// Bases the chain leaves out (mismatches, read ends without a unique k-mer,
+// bases given up to slide a junction onto its motif) are segmented by the exact
+// DP against the reference next to the flanking segments, so the result tiles
+// the query like every other mode. With regions, the windows are clipped to them.
+const uint64 SPLICE_FILL_PAD = 32;
+
+vector<MatchSegment> fill_spliced_gaps(const string &seq, const string &ref, const vector<MatchSegment> &chain,
+                                       const vector<RefRegion> &regions) {
+    vector<MatchSegment> result;
+    uint64 pos = 0;
+    auto fill = [&](uint64 end, const MatchSegment *prev, const MatchSegment *next) {
+        if (end <= pos) return;
+        const long long gap = end - pos, pad = SPLICE_FILL_PAD, last = static_cast<long long>(ref.size()) - 1;
+        vector<RefRegion> windows;
+        auto window = [&](long long lo, long long hi) {
+            lo = max(0LL, lo);
+            hi = min(last, hi);
+            if (regions.empty() && lo <= hi) windows.push_back({static_cast<uint64>(lo), static_cast<uint64>(hi)});
+            for (const RefRegion &r : regions) {
+                const long long a = max<long long>(lo, r.start), b = min<long long>(hi, r.end);
+                if (a <= b) windows.push_back({static_cast<uint64>(a), static_cast<uint64>(b)});
+            }
+        };
+        if (prev) window(static_cast<long long>(prev->ref_info.end) + 1 - pad, static_cast<long long>(prev->ref_info.end) + gap + pad);
+        if (next) window(static_cast<long long>(next->ref_info.start) - gap - pad, static_cast<long long>(next->ref_info.start) - 1 + pad);
+        windows = normalize_regions(windows, ref.size());
+        RefMap local = build_reference_index(ref, windows);
+        for (MatchSegment seg : segment_verified(string_view(seq).substr(pos, gap), ref, local, windows)) {
+            seg.query_start += pos;
+            seg.query_end += pos;
+            result.push_back(seg);
+        }
+    };
+    for (size_t i = 0; i < chain.size(); ++i) {
+        fill(chain[i].query_start, i ? &chain[i - 1] : nullptr, &chain[i]);
+        result.push_back(chain[i]);
+        pos = chain[i].query_end + 1;
+    }
+    fill(seq.size(), chain.empty() ? nullptr : &chain.back(), nullptr);
+    return result;
+}
+
+// Segments of the better-scoring strand, in query order, covering the query;
+// the introns of the chain go to junctions when given
+vector<MatchSegment> align_spliced(const string &query, const string &ref, const UniqueKmerIndex &index,
+                                   vector<SpliceJunction> *junctions = nullptr) {
+    const uint64 n = query.size();
+    vector<MatchSegment> forward, backward;
+    for (const MatchSegment &run : find_kmer_runs(index, query, 0)) {
+        if (!run.ref_info.reverse) {
+            forward.push_back(run);
+        } else {
+            // the reverse-complemented query matches the forward reference here
+            backward.push_back({RefSeq{run.ref_info.start, run.ref_info.end, false},
+                                n - 1 - run.query_end, n - 1 - run.query_start});
+        }
+    }
+    long long forward_score = 0, backward_score = 0;
+    vector<MatchSegment> chain = chain_spliced_segments(forward, ref, forward_score);
+    vector<MatchSegment> other = chain_spliced_segments(backward, ref, backward_score);
+    const bool flip = backward_score > forward_score;
+    if (flip) chain = move(other);
+    if (chain.empty()) throw runtime_error("No spliced alignment: query shares no unique k-mer with the reference");
+
+    // back from the reverse-complemented frame: query order and strands flip
+    auto to_query_frame = [&](const vector<MatchSegment> &segments) {
+        if (!flip) return segments;
+        vector<MatchSegment> out;
+        for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+            out.push_back({RefSeq{it->ref_info.start, it->ref_info.end, !it->ref_info.reverse},
+                           n - 1 - it->query_end, n - 1 - it->query_start});
+        }
+        return out;
+    };
+    if (junctions) *junctions = splice_junctions(ref, to_query_frame(chain));
+    return to_query_frame(fill_spliced_gaps(flip ? reverse_dna(query) : query, ref, chain, index.regions));
+}
+
+UniqueKmerIndex build_spliced_index(const string &ref, unsigned threads, const vector<RefRegion> &regions = {}) {
+    return build_unique_kmer_index(ref, max(MIN_SPLICED_K, select_unique_kmer_spectrum(pack_dna(ref), threads).k), threads,
+                                   regions);
+}
+
+// Saved index: the two-strand hash index as a flat open-addressing table that is
+// mmap'd instead of rebuilt. Layout: 64-byte header ("DNAIDX01", hash base and
+// seed, capacity, entries, reference length and checksum) followed by capacity
+// FlatSlots, linear probing from SeededHash(key) & (capacity - 1).
+const char INDEX_MAGIC[8] = {'D', 'N', 'A', 'I', 'D', 'X', '0', '1'};
+const uint64 FLAT_EMPTY = ~0ULL;  // never a hash value, which is < MOD
+
+struct FlatSlot {
+    uint64 first;
+    RefSeq second;
+};
+static_assert(sizeof(FlatSlot) == 32, "FlatSlot is part of the index file format");
+
+struct IndexFileHeader {
+    char magic[8];
+    uint64 base;
+    uint64 seed;
+    uint64 capacity;
+    uint64 entries;
+    uint64 ref_len;
+    uint64 ref_checksum;
+    uint64 reserved;
+};
+static_assert(sizeof(IndexFileHeader) == 64, "IndexFileHeader is part of the index file format");
+
+// Read-only view with the lookup interface find_optimal_path expects from RefMap
+struct FlatRefIndex {
+    const FlatSlot *slots = nullptr;
+    uint64 mask = 0;
+    SeededHash key;
+
+    const SeededHash &hash_function() const { return key; }
+    const FlatSlot *end() const { return nullptr; }
+    const FlatSlot *find(uint64 hash) const {
+        for (uint64 i = key(hash) & mask;; i = (i + 1) & mask) {
+            if (slots[i].first == hash) return &slots[i];
+            if (slots[i].first == FLAT_EMPTY) return nullptr;
+        }
+    }
+};
+
+uint64 fnv1a(const string &s) {
+    uint64 h = 0xCBF29CE484222325ULL;
+    for (char c : s) h = (h ^ static_cast<unsigned char>(c)) * 0x100000001B3ULL;
+    return h;
+}
+
+// Radix-sorted construction of the flat table: every (substring hash, position)
+// pair is extracted into one array in the order build_reference_hash visits
+// them, sorted by the slot key with a stable parallel LSD radix sort, and the
+// first pair of each run of equal hashes (the one RefMap would keep) is placed
+// by a sequential sweep in home-slot order, so no insert probes a random line.
+const unsigned RADIX_BITS = 8;
+
+struct HashedPosition {
+    uint64 key;     // SeededHash(hash) rotated so its home-slot bits come first
+    uint64 hash;
+    uint64 packed;  // start << 33 | end << 1 | reverse
+};
+
+// Stable sort by the low `bits` bits of key(record), RADIX_BITS per pass; each
+// pass counts digits per thread chunk, then scatters chunks to disjoint ranges
+template <class Record, class Key>
+void parallel_radix_sort(vector<Record> &records, const Key &key, unsigned bits, unsigned threads) {
+    const size_t n = records.size(), buckets = size_t(1) << RADIX_BITS;
+    threads = max(1u, min<unsigned>(threads, max<size_t>(1, n / 65536)));
+    const size_t chunk = (n + threads - 1) / threads;
+    vector<Record> scratch(n);
+    vector<vector<size_t>> offset(threads, vector<size_t>(buckets));
+    auto run = [&](const function<void(unsigned, size_t, size_t)> &fn) {
+        vector<thread> pool;
+        for (unsigned t = 0; t < threads; ++t) pool.emplace_back(fn, t, min(n, t * chunk), min(n, (t + 1) * chunk));
+        for (thread &th : pool) th.join();
+    };
+    for (unsigned shift = 0; shift < bits; shift += RADIX_BITS) {
+        run([&](unsigned t, size_t begin, size_t end) {
+            fill(offset[t].begin(), offset[t].end(), 0);
+            for (size_t i = begin; i < end; ++i) ++offset[t][(key(records[i]) >> shift) & (buckets - 1)];
+        });
+        size_t sum = 0, largest = 0;
+        for (size_t d = 0; d < buckets; ++d) {
+            size_t count = 0;
+            for (unsigned t = 0; t < threads; ++t) {
+                const size_t c = offset[t][d];
+                offset[t][d] = sum;
+                sum += c;
+                count += c;
+            }
+            largest = max(largest, count);
+        }
+        if (largest == n) continue;  // every key has this digit
+        run([&](unsigned t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) scratch[offset[t][(key(records[i]) >> shift) & (buckets - 1)]++] = records[i];
+        });
+        records.swap(scratch);
+    }
+}
+
+struct FlatRefTable {
+    vector<FlatSlot> slots;
+    uint64 entries = 0;
+    FlatRefIndex view;  // points into slots, which moves keep in place
+
+    FlatRefTable() = default;
+    FlatRefTable(FlatRefTable &&) = default;
+    FlatRefTable &operator=(FlatRefTable &&) = default;
+};
+
+FlatRefTable build_flat_reference_index(const string &ref, const vector<RefRegion> &regions, bool bisulfite,
+                                        unsigned threads) {
+    if (ref.size() >= (1ULL << 31)) throw runtime_error("Reference too long for the flat index");
+    SeededHash key = new_hash_key();
+    key.bisulfite = bisulfite;
+    threads = max(1u, threads);
+
+    // one row per (strand, slice, start), in build_reference_index order
+    struct Row { uint32_t slice; bool reverse; uint32_t start; };
+    vector<RefRegion> slices = regions;
+    if (slices.empty()) slices.push_back({0, ref.size() - 1});
+    vector<string> strands;
+    vector<Row> rows;
+    vector<uint64> row_offset = {0};
+    for (const bool reverse : {false, true}) {
+        for (uint32_t s = 0; s < slices.size(); ++s) {
+            const string slice = ref.substr(slices[s].start, slices[s].end - slices[s].start + 1);
+            strands.push_back(reverse ? reverse_dna(slice) : slice);
+            for (uint32_t start = 0; start < slice.size(); ++start) {
+                rows.push_back({s, reverse, start});
+                row_offset.push_back(row_offset.back() + slice.size() - start);
+            }
+        }
+    }
+    const uint64 total = row_offset.back();
+    uint64 capacity = 2;
+    while (capacity < 2 * total) capacity <<= 1;
+    const unsigned slot_bits = __builtin_ctzll(capacity);
+    auto rotate = [&](uint64 mixed) { return (mixed << (64 - slot_bits)) | (mixed >> slot_bits); };
+
+    vector<HashedPosition> pairs(total);
+    vector<thread> pool;
+    for (unsigned t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t]() {
+            // rows split by pair count, not row count
+            const auto first = row_offset.begin(), last = row_offset.begin() + rows.size();
+            const size_t lo = lower_bound(first, last, total * t / threads) - first;
+            const size_t hi = lower_bound(first, last, total * (t + 1) / threads) - first;
+            for (size_t r = lo; r < hi; ++r) {
+                const Row &row = rows[r];
+                const string &seq = strands[row.reverse * slices.size() + row.slice];
+                const uint64 len = seq.size(), offset = slices[row.slice].start;
+                HashedPosition *out = &pairs[row_offset[r]];
+                uint64 hash = 0;
+                for (uint64 end = row.start; end < len; ++end) {
+                    hash = hash_step(hash, key.base, bisulfite ? bisulfite_base(seq[end]) : seq[end]);
+                    const uint64 lo_pos = row.reverse ? len - end - 1 + offset : row.start + offset;
+                    const uint64 hi_pos = row.reverse ? len - row.start - 1 + offset : end + offset;
+                    *out++ = {rotate(key(hash)), hash, lo_pos << 33 | hi_pos << 1 | row.reverse};
+                }
+            }
+        });
+    }
+    for (thread &th : pool) th.join();
+    strands.clear();
+
+    parallel_radix_sort(pairs, [](const HashedPosition &p) { return p.key; }, 64, threads);
+    size_t distinct = 0;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        if (distinct == 0 || pairs[i].hash != pairs[distinct - 1].hash) pairs[distinct++] = pairs[i];
+    }
+    pairs.resize(distinct);
+
+    // repeats shrink the table below the size the sort key was rotated for
+    FlatRefTable table;
+    table.entries = distinct;
+    uint64 slots = 2;
+    while (slots < 2 * distinct) slots <<= 1;
+    const uint64 mask = slots - 1;
+    auto home = [&](const HashedPosition &p) { return (p.key >> (64 - slot_bits)) & mask; };
+    if (slots < capacity) parallel_radix_sort(pairs, home, __builtin_ctzll(slots), threads);
+
+    table.slots.assign(slots, FlatSlot{FLAT_EMPTY, RefSeq{0, 0, false}});
+    vector<size_t> wrapped;
+    uint64 next = 0;
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        const HashedPosition &p = pairs[i];
+        const uint64 pos = max(home(p), next);
+        if (pos > mask) {
+            wrapped.push_back(i);
+            continue;
+        }
+        table.slots[pos] = FlatSlot{p.hash, RefSeq{p.packed >> 33, (p.packed >> 1) & 0xFFFFFFFFULL, (p.packed & 1) != 0}};
+        next = pos + 1;
+    }
+    for (size_t i : wrapped) {
+        const HashedPosition &p = pairs[i];
+        uint64 pos = home(p);
+        while (table.slots[pos].first != FLAT_EMPTY) pos = (pos + 1) & mask;
+        table.slots[pos] = FlatSlot{p.hash, RefSeq{p.packed >> 33, (p.packed >> 1) & 0xFFFFFFFFULL, (p.packed & 1) != 0}};
+    }
+    table.view = FlatRefIndex{table.slots.data(), mask, key};
+    return table;
+}
+
+void save_reference_index(const string &ref, const string &path, unsigned threads) {
+    const FlatRefTable table = build_flat_reference_index(ref, {}, false, threads);
+    const vector<FlatSlot> &slots = table.slots;
+    const SeededHash &key = table.view.key;
+    IndexFileHeader header{};
+    memcpy(header.magic, INDEX_MAGIC, 8);
+    header.base = key.base;
+    header.seed = key.seed;
+    header.capacity = slots.size();
+    header.entries = table.entries;
+    header.ref_len = ref.size();
+    header.ref_checksum = fnv1a(ref);
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out) throw runtime_error("Cannot write " + path);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(slots.data()), slots.size() * sizeof(FlatSlot));
+    cerr << "Saved index of " << table.entries << " substrings (" << (sizeof(header) + slots.size() * sizeof(FlatSlot)) / (1 << 20)
+         << " MB) to " << path << "\n";
+}
+
+#ifdef __linux__
+// Warm-up so the first queries do not fault pages in one by one: readahead and
+// MADV_WILLNEED start the I/O, then threads touch every page of their stripe,
+// optionally followed by mlock. Reports time spent and bytes resident.
+void warm_up_mapping(int fd, void *addr, size_t size, unsigned threads, bool lock) {
+    const auto t0 = chrono::steady_clock::now();
+    const size_t page = sysconf(_SC_PAGESIZE);
+    readahead(fd, 0, size);
+    madvise(addr, size, MADV_WILLNEED);
+
+    const size_t pages = (size + page - 1) / page;
+    threads = max(1u, threads);
+    vector<uint64> sums(threads, 0);
+    vector<thread> pool;
+    for (unsigned t = 0; t < threads; ++t) {
+        pool.emplace_back([&, t]() {
+            const volatile unsigned char *base = static_cast<const unsigned char *>(addr);
+            uint64 sum = 0;
+            for (size_t p = t * pages / threads; p < (t + 1) * pages / threads; ++p) sum += base[p * page];
+            sums[t] = sum;
+        });
+    }
+    for (thread &th : pool) th.join();
+
+    bool locked = false;
+    if (lock) {
+        locked = mlock(addr, size) == 0;
+        if (!locked) cerr << "Warning: mlock of index failed: " << strerror(errno) << "\n";
+    }
+
+    vector<unsigned char> residency(pages);
+    size_t resident = 0;
+    if (mincore(addr, size, residency.data()) == 0) {
+        for (unsigned char r : residency) resident += r & 1;
+    }
+    const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    cerr << "Index warm-up: " << fixed << setprecision(1) << size / 1048576.0 << " MB mapped, "
+         << min(resident * page, size) / 1048576.0 << " MB resident, " << ms << " ms with " << threads
+         << " threads" << (locked ? ", locked" : "") << "\n";
+}
+
+struct MappedIndex {
+    void *addr = MAP_FAILED;
+    size_t size = 0;
+    FlatRefIndex view;
+
+    MappedIndex() = default;
+    MappedIndex(const MappedIndex &) = delete;
+    MappedIndex &operator=(const MappedIndex &) = delete;
+    ~MappedIndex() {
+        if (addr != MAP_FAILED) munmap(addr, size);
+    }
+};
+
+// Maps an index written by save_reference_index and checks it belongs to ref
+unique_ptr<MappedIndex> open_reference_index(const string &path, const string &ref, unsigned threads, bool lock) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Cannot open " + path);
+    struct stat st;
+    fstat(fd, &st);
+    auto mapped = make_unique<MappedIndex>();
+    mapped->size = st.st_size;
+    if (mapped->size >= sizeof(IndexFileHeader)) {
+        mapped->addr = mmap(nullptr, mapped->size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (mapped->addr == MAP_FAILED) {
+        close(fd);
+        throw runtime_error("Cannot map " + path);
+    }
+    const IndexFileHeader *header = static_cast<const IndexFileHeader *>(mapped->addr);
+    const bool valid = memcmp(header->magic, INDEX_MAGIC, 8) == 0 && header->capacity &&
+                       (header->capacity & (header->capacity - 1)) == 0 &&
+                       sizeof(IndexFileHeader) + header->capacity * sizeof(FlatSlot) == mapped->size;
+    if (!valid) {
+        close(fd);
+        throw runtime_error(path + " is not an index file");
+    }
+    if (header->ref_len != ref.size() || header->ref_checksum != fnv1a(ref)) {
+        close(fd);
+        throw runtime_error(path + " was built for a different reference");
+    }
+    warm_up_mapping(fd, mapped->addr, mapped->size, threads, lock);
+    close(fd);
+    mapped->view.slots = reinterpret_cast<const FlatSlot *>(header + 1);
+    mapped->view.mask = header->capacity - 1;
+    mapped->view.key = SeededHash{header->base, header->seed};
+    return mapped;
+}
+#else
+// Saved indexes are only mapped on Linux; --save-index still writes them
+struct MappedIndex {
+    FlatRefIndex view;
+};
+
+unique_ptr<MappedIndex> open_reference_index(const string &, const string &, unsigned, bool) {
+    throw runtime_error("--index needs a Linux build (memory-mapped files)");
+}
+#endif
+
+// Variation graph: the reference plus known variants from a VCF-style file. Each
+// variant opens alternative paths: the reference window of GRAPH_CONTEXT bases
+// on either side with the alt allele, alone and together with up to
+// MAX_GRAPH_NEIGHBOURS nearby variants. Substrings of a path that span its alt
+// alleles are indexed on both strands next to the reference substrings (which
+// take precedence), mapped back to reference coordinates, so a read carrying
+// known alleles matches one graph substring instead of breaking at each allele.
+const uint64 GRAPH_CONTEXT = 150;
+const size_t MAX_GRAPH_NEIGHBOURS = 4;
+
+struct Variant {
+    uint64 pos;  // 0-based
+    string ref_allele;
+    string alt;
+};
+
+// CHROM POS ID REF ALT per line (POS 1-based, '#' lines skipped, multiple ALTs
+// split); REF must match the reference
+vector<Variant> read_variants(const string &path, const string &ref) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Cannot open " + path);
+    vector<Variant> variants;
+    string line;
+    for (size_t line_no = 1; getline(in, line); ++line_no) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        string chrom, id, ref_allele, alts;
+        uint64 pos = 0;
+        if (!(fields >> chrom >> pos >> id >> ref_allele >> alts) || pos == 0) {
+            throw runtime_error(path + ":" + to_string(line_no) + ": expected 'CHROM POS ID REF ALT'");
+        }
+        to_upper(ref_allele);
+        if (pos - 1 + ref_allele.size() > ref.size() || ref.compare(pos - 1, ref_allele.size(), ref_allele) != 0) {
+            throw runtime_error(path + ":" + to_string(line_no) + ": REF does not match the reference at " + to_string(pos));
+        }
+        istringstream alt_list(alts);
+        for (string alt; getline(alt_list, alt, ',');) {
+            to_upper(alt);
+            if (alt.empty() || alt.find_first_not_of("ACGT") != string::npos) continue;  // symbolic or '*'
+            if (alt != ref_allele) variants.push_back({pos - 1, ref_allele, alt});
+        }
+    }
+    sort(variants.begin(), variants.end(), [](const Variant &a, const Variant &b) { return a.pos < b.pos; });
+    return variants;
+}
+
+struct GraphPath {
+    string seq;
+    vector<uint64> ref_pos;     // reference coordinate of each path base
+    vector<uint32_t> variants;  // alt alleles on this path
+    size_t changed_lo = 0;      // path span from the first to the last alt base
+    size_t changed_hi = 0;      // (plus the base after a deletion)
+};
+
+// Same find/end/hash_function interface as RefMap for find_optimal_path
+struct GraphIndex {
+    RefMap ref_map;
+    RefMap alt_map;
+    vector<GraphPath> paths;
+    unordered_map<uint64, pair<uint32_t, uint32_t>, SeededHash> alt_origin;  // hash -> (path, offset on its strand)
+
+    SeededHash hash_function() const { return ref_map.hash_function(); }
+    const RefMap::value_type *end() const { return nullptr; }
+    const RefMap::value_type *find(uint64 hash) const {
+        if (const auto it = ref_map.find(hash); it != ref_map.end()) return &*it;
+        const auto it = alt_map.find(hash);
+        return it == alt_map.end() ? nullptr : &*it;
+    }
+};
+
+// Path from the reference window [lo, hi] with the given variants applied
+GraphPath build_graph_path(const string &ref, const vector<Variant> &variants, const vector<uint32_t> &applied,
+                           uint64 lo, uint64 hi) {
+    GraphPath path;
+    uint64 pos = lo;
+    for (const uint32_t v : applied) {
+        const Variant &var = variants[v];
+        for (; pos < var.pos; ++pos) {
+            path.seq.push_back(ref[pos]);
+            path.ref_pos.push_back(pos);
+        }
+        if (path.variants.empty()) path.changed_lo = path.seq.size();
+        for (size_t i = 0; i < var.alt.size(); ++i) {
+            path.seq.push_back(var.alt[i]);
+            path.ref_pos.push_back(var.pos + min(i, var.ref_allele.size() - 1));
+        }
+        path.changed_hi = path.seq.size() - (var.alt.size() < var.ref_allele.size() ? 0 : 1);
+        path.variants.push_back(v);
+        pos = var.pos + var.ref_allele.size();
+    }
+    for (; pos <= hi; ++pos) {
+        path.seq.push_back(ref[pos]);
+        path.ref_pos.push_back(pos);
+    }
+    path.changed_hi = min(path.changed_hi, path.seq.size() - 1);
+    return path;
+}
+
+// Substrings covering [need_lo, need_hi] of the path, on the strand given
+void index_graph_path(GraphIndex &graph, uint32_t path_id, bool reverse, size_t need_lo, size_t need_hi) {
+    const GraphPath &path = graph.paths[path_id];
+    const size_t len = path.seq.size();
+    const string seq = reverse ? reverse_dna(path.seq) : path.seq;
+    if (reverse) {
+        const size_t lo = len - 1 - need_hi;
+        need_hi = len - 1 - need_lo;
+        need_lo = lo;
+    }
+    const uint64 base = graph.ref_map.hash_function().base;
+    for (size_t start = 0; start <= need_lo; ++start) {
+        uint64 hash = 0;
+        for (size_t end = start; end < len; ++end) {
+            hash = hash_step(hash, base, seq[end]);
+            if (end < need_hi || graph.ref_map.count(hash) || graph.alt_map.count(hash)) continue;
+            const size_t first = reverse ? len - 1 - end : start, last = reverse ? len - 1 - start : end;
+            graph.alt_map[hash] = RefSeq{path.ref_pos[first], path.ref_pos[last], reverse};
+            graph.alt_origin[hash] = {path_id, static_cast<uint32_t>(start)};
+        }
+    }
+}
+
+GraphIndex build_graph_index(const string &ref, const vector<Variant> &variants) {
+    GraphIndex graph{build_reference_index(ref), RefMap{}, {}, {}};
+    graph.alt_map = RefMap(0, graph.ref_map.hash_function());
+    graph.alt_origin = decltype(graph.alt_origin)(0, graph.ref_map.hash_function());
+    set<vector<uint32_t>> built;
+    for (uint32_t v = 0; v < variants.size(); ++v) {
+        const Variant &var = variants[v];
+        const uint64 lo = var.pos > GRAPH_CONTEXT ? var.pos - GRAPH_CONTEXT : 0;
+        const uint64 hi = min<uint64>(ref.size() - 1, var.pos + var.ref_allele.size() - 1 + GRAPH_CONTEXT);
+        // nearest compatible neighbours inside the window; variants are sorted by position
+        const auto by_pos = [](const Variant &o, uint64 pos) { return o.pos < pos; };
+        const uint32_t first = lower_bound(variants.begin(), variants.end(), lo, by_pos) - variants.begin();
+        const uint32_t last = lower_bound(variants.begin() + first, variants.end(), hi + 1, by_pos) - variants.begin();
+        vector<uint32_t> near;
+        for (uint32_t u = first; u < last; ++u) {
+            const Variant &o = variants[u];
+            if (u == v || o.pos + o.ref_allele.size() - 1 > hi) continue;
+            if (o.pos < var.pos + var.ref_allele.size() && var.pos < o.pos + o.ref_allele.size()) continue;  // overlaps v
+            near.push_back(u);
+        }
+        sort(near.begin(), near.end(), [&](uint32_t a, uint32_t b) {
+            const auto dist = [&](uint32_t u) { return variants[u].pos > var.pos ? variants[u].pos - var.pos : var.pos - variants[u].pos; };
+            return dist(a) < dist(b);
+        });
+        if (near.size() > MAX_GRAPH_NEIGHBOURS) near.resize(MAX_GRAPH_NEIGHBOURS);
+        for (uint32_t mask = 0; mask < (1u << near.size()); ++mask) {
+            vector<uint32_t> applied = {v};
+            for (size_t i = 0; i < near.size(); ++i) {
+                if (mask >> i & 1) applied.push_back(near[i]);
+            }
+            sort(applied.begin(), applied.end());
+            bool overlapping = false;
+            for (size_t i = 1; i < applied.size(); ++i) {
+                const Variant &a = variants[applied[i - 1]];
+                overlapping |= a.pos + a.ref_allele.size() > variants[applied[i]].pos;
+            }
+            if (overlapping || !built.insert(applied).second) continue;
+            graph.paths.push_back(build_graph_path(ref, variants, applied, lo, hi));
+            const GraphPath &path = graph.paths.back();
+            const uint32_t id = static_cast<uint32_t>(graph.paths.size() - 1);
+            index_graph_path(graph, id, false, path.changed_lo, path.changed_hi);
+            index_graph_path(graph, id, true, path.changed_lo, path.changed_hi);
+        }
+    }
+    return graph;
+}
+
+// Reference segments are checked as usual, the others against the graph path their hash names
+bool verify_graph_segments(const string &query, const string &ref, const GraphIndex &graph,
+                           const vector<MatchSegment> &segments) {
+    const uint64 base = graph.hash_function().base;
+    for (const MatchSegment &seg : segments) {
+        if (verify_segments(query, ref, {seg})) continue;
+        const size_t len = seg.query_end - seg.query_start + 1;
+        uint64 hash = 0;
+        for (size_t i = seg.query_start; i <= seg.query_end; ++i) hash = hash_step(hash, base, query[i]);
+        const auto it = graph.alt_origin.find(hash);
+        if (it == graph.alt_origin.end()) return false;
+        const GraphPath &path = graph.paths[it->second.first];
+        const string seq = seg.ref_info.reverse ? reverse_dna(path.seq) : path.seq;
+        if (it->second.second + len > seq.size() || seq.compare(it->second.second, len, query, seg.query_start, len) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Alt alleles a graph segment carries, as "POS:REF>ALT" (1-based), comma separated
+string graph_segment_alleles(const string &query, const GraphIndex &graph, const vector<Variant> &variants,
+                             const MatchSegment &seg) {
+    const uint64 base = graph.hash_function().base;
+    uint64 hash = 0;
+    for (size_t i = seg.query_start; i <= seg.query_end; ++i) hash = hash_step(hash, base, query[i]);
+    if (graph.ref_map.count(hash)) return "";
+    const auto it = graph.alt_origin.find(hash);
+    if (it == graph.alt_origin.end()) return "";
+    string alleles;
+    for (const uint32_t v : graph.paths[it->second.first].variants) {
+        const Variant &var = variants[v];
+        if (var.pos + var.ref_allele.size() <= seg.ref_info.start || var.pos > seg.ref_info.end) continue;
+        alleles += (alleles.empty() ? "" : ",") + to_string(var.pos + 1) + ":" + var.ref_allele + ">" + var.alt;
+    }
+    return alleles;
+}
+
+// Whole-query DP over the graph; a failed check rebuilds the graph under a new key
+vector<MatchSegment> align_graph_query(const string &query, const string &ref, const GraphIndex &graph,
+                                       const vector<Variant> &variants) {
+    auto segments = reconstruct_path(find_optimal_path(query, graph), query.size());
+    if (verify_graph_segments(query, ref, graph, segments)) return segments;
+    for (int attempt = 2; attempt <= HASH_VERIFY_ATTEMPTS; ++attempt) {
+        const GraphIndex fresh = build_graph_index(ref, variants);
+        segments = reconstruct_path(find_optimal_path(query, fresh), query.size());
+        if (verify_graph_segments(query, ref, fresh, segments)) return segments;
+    }
+    throw runtime_error("Segment verification failed after " + to_string(HASH_VERIFY_ATTEMPTS) + " hash keys");
+}
+
+// Batch mode: many queries against one reference on a thread pool. Results go
+// either to a TSV on stdout or to a columnar binary file (little-endian, native
+// widths) that readers can mmap and use in place:
+//   header: "DNASEGC1", uint32 version, uint32 column count,
+//           per column { char name[12]; uint32 byte width }
+//   record batch: "BTCH", uint32 column count, uint64 rows, then each column's
+//           values back to back, every array zero-padded to a multiple of 8 bytes
+const char COLUMNAR_MAGIC[8] = {'D', 'N', 'A', 'S', 'E', 'G', 'C', '1'};
+const char BATCH_MAGIC[4] = {'B', 'T', 'C', 'H'};
+const uint32_t COLUMNAR_VERSION = 1;
+const size_t COLUMNAR_BATCH_ROWS = 1 << 16;
+
+struct ColumnSpec {
+    const char *name;
+    uint32_t width;
+};
+
+const ColumnSpec COLUMNAR_SCHEMA[] = {
+    {"query_id", 4}, {"query_start", 4}, {"query_end", 4}, {"ref_start", 8}, {"ref_end", 8}, {"strand", 1},
+};
+const uint32_t COLUMNAR_COLUMNS = sizeof(COLUMNAR_SCHEMA) / sizeof(COLUMNAR_SCHEMA[0]);
+
+// One per worker thread; flushed as a record batch when it reaches COLUMNAR_BATCH_ROWS
+struct ColumnBuffer {
+    vector<uint32_t> query_id, query_start, query_end;
+    vector<uint64_t> ref_start, ref_end;
+    vector<uint8_t> strand;  // 0 forward, 1 reverse complement
+
+    size_t rows() const { return query_id.size(); }
+
+    void append(uint32_t id, const MatchSegment &seg) {
+        query_id.push_back(id);
+        query_start.push_back(static_cast<uint32_t>(seg.query_start));
+        query_end.push_back(static_cast<uint32_t>(seg.query_end));
+        ref_start.push_back(seg.ref_info.start);
+        ref_end.push_back(seg.ref_info.end);
+        strand.push_back(seg.ref_info.reverse ? 1 : 0);
+    }
+
+    void clear() {
+        query_id.clear(); query_start.clear(); query_end.clear();
+        ref_start.clear(); ref_end.clear(); strand.clear();
+    }
+};
+
+struct ColumnarWriter {
+    ofstream out;
+    mutex lock;
+    uint64 batches = 0;
+    uint64 rows = 0;
+};
+
+void write_padded(ostream &out, const void *data, size_t bytes) {
+    static const char zeros[8] = {};
+    out.write(static_cast<const char *>(data), bytes);
+    if (bytes % 8) out.write(zeros, 8 - bytes % 8);
+}
+
+void open_columnar_writer(ColumnarWriter &writer, const string &path) {
+    writer.out.open(path, ios::binary | ios::trunc);
+    if (!writer.out) throw runtime_error("Cannot write " + path);
+    writer.out.write(COLUMNAR_MAGIC, 8);
+    writer.out.write(reinterpret_cast<const char *>(&COLUMNAR_VERSION), 4);
+    writer.out.write(reinterpret_cast<const char *>(&COLUMNAR_COLUMNS), 4);
+    for (const ColumnSpec &col : COLUMNAR_SCHEMA) {
+        char name[12] = {};
+        memcpy(name, col.name, min(strlen(col.name), sizeof(name)));
+        writer.out.write(name, sizeof(name));
+        writer.out.write(reinterpret_cast<const char *>(&col.width), 4);
+    }
+}
+
+void flush_column_buffer(ColumnarWriter &writer, ColumnBuffer &buf) {
+    if (buf.rows() == 0) return;
+    const uint64 rows = buf.rows();
+    {
+        lock_guard<mutex> guard(writer.lock);
+        writer.out.write(BATCH_MAGIC, 4);
+        writer.out.write(reinterpret_cast<const char *>(&COLUMNAR_COLUMNS), 4);
+        writer.out.write(reinterpret_cast<const char *>(&rows), 8);
+        write_padded(writer.out, buf.query_id.data(), rows * 4);
+        write_padded(writer.out, buf.query_start.data(), rows * 4);
+        write_padded(writer.out, buf.query_end.data(), rows * 4);
+        write_padded(writer.out, buf.ref_start.data(), rows * 8);
+        write_padded(writer.out, buf.ref_end.data(), rows * 8);
+        write_padded(writer.out, buf.strand.data(), rows);
+        writer.batches++;
+        writer.rows += rows;
+    }
+    buf.clear();
+}
+
+// A whole file's bytes, 8-byte aligned: mapped in place on Linux, read into memory elsewhere
+struct FileBytes {
+    const char *data = nullptr;
+    size_t size = 0;
+#ifdef __linux__
+    void *map = MAP_FAILED;
+    ~FileBytes() {
+        if (map != MAP_FAILED) munmap(map, size);
+    }
+#else
+    vector<uint64> buffer;
+#endif
+    FileBytes() = default;
+    FileBytes(const FileBytes &) = delete;
+    FileBytes &operator=(const FileBytes &) = delete;
+};
+
+void load_file_bytes(const string &path, FileBytes &file) {
+#ifdef __linux__
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw runtime_error("Cannot open " + path);
+    struct stat st;
+    fstat(fd, &st);
+    file.size = st.st_size;
+    file.map = file.size ? mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (file.map == MAP_FAILED) throw runtime_error("Cannot map " + path);
+    file.data = static_cast<const char *>(file.map);
+#else
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in) throw runtime_error("Cannot open " + path);
+    file.size = static_cast<size_t>(in.tellg());
+    file.buffer.resize((file.size + 7) / 8);
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(file.buffer.data()), file.size)) throw runtime_error("Cannot read " + path);
+    file.data = reinterpret_cast<const char *>(file.buffer.data());
+#endif
+}
+
+// Reads a columnar result file in place and prints it as TSV
+void dump_columnar_results(const string &path) {
+    FileBytes file;
+    load_file_bytes(path, file);
+    const char *base = file.data;
+    const size_t size = file.size;
+
+    const size_t header_size = 16 + COLUMNAR_COLUMNS * 16;
+    uint32_t version = 0, columns = 0;
+    if (size >= 16) {
+        memcpy(&version, base + 8, 4);
+        memcpy(&columns, base + 12, 4);
+    }
+    if (size < header_size || memcmp(base, COLUMNAR_MAGIC, 8) != 0 || version != COLUMNAR_VERSION ||
+        columns != COLUMNAR_COLUMNS) {
+        throw runtime_error(path + " is not a columnar result file");
+    }
+
+    auto padded = [](size_t bytes) { return (bytes + 7) / 8 * 8; };
+    cout << "query_id\tquery_start\tquery_end\tref_start\tref_end\tstrand\n";
+    for (size_t off = header_size; off + 16 <= size;) {
+        if (memcmp(base + off, BATCH_MAGIC, 4) != 0) break;
+        uint64 rows = 0;
+        memcpy(&rows, base + off + 8, 8);
+        // every row takes 29 bytes before padding; check before forming any column pointer
+        const size_t remaining = size - off - 16;
+        if (rows > remaining / 29 || 3 * padded(rows * 4) + 2 * padded(rows * 8) + padded(rows) > remaining) {
+            throw runtime_error(path + " is truncated or corrupt: batch of " + to_string(rows) + " rows at byte " +
+                                to_string(off) + " runs past the end");
+        }
+        const char *p = base + off + 16;
+        const uint32_t *query_id = reinterpret_cast<const uint32_t *>(p);
+        const uint32_t *query_start = reinterpret_cast<const uint32_t *>(p += padded(rows * 4));
+        const uint32_t *query_end = reinterpret_cast<const uint32_t *>(p += padded(rows * 4));
+        const uint64_t *ref_start = reinterpret_cast<const uint64_t *>(p += padded(rows * 4));
+        const uint64_t *ref_end = reinterpret_cast<const uint64_t *>(p += padded(rows * 8));
+        const uint8_t *strand = reinterpret_cast<const uint8_t *>(p += padded(rows * 8));
+        p += padded(rows);
+        for (uint64 r = 0; r < rows; ++r) {
+            cout << query_id[r] << '\t' << query_start[r] << '\t' << query_end[r] << '\t'
+                 << ref_start[r] << '\t' << ref_end[r] << '\t' << (strand[r] ? '-' : '+') << '\n';
+        }
+        off = p - base;
+    }
+}
+
+// Runs fn(worker, id) for every id in [0, count) on `threads` workers, each
+// claiming `dispatch_batch` consecutive ids at a time
+void parallel_dispatch(size_t count, unsigned threads, size_t dispatch_batch,
+                       const function<void(unsigned, size_t)> &fn) {
+    atomic<size_t> next{0};
+    dispatch_batch = max<size_t>(1, dispatch_batch);
+    auto worker = [&](unsigned w) {
+        for (size_t first; (first = next.fetch_add(dispatch_batch)) < count;) {
+            for (size_t id = first; id < min(count, first + dispatch_batch); ++id) fn(w, id);
+        }
+    };
+    vector<thread> pool;
+    for (unsigned w = 0; w < max(1u, threads); ++w) pool.emplace_back(worker, w);
+    for (thread &t : pool) t.join();
+}
+
+// Taxonomic classification: every canonical k-mer of a reference collection maps
+// to the lowest common ancestor of the taxa containing it, kept in a compact
+// open-addressing table (64-bit k-mers and 32-bit taxa in separate arrays). A
+// read goes to the taxon whose root-to-node path collects the most k-mer hits;
+// ties go to the LCA of the tied taxa.
+const unsigned CLASSIFY_K = 31;
+const uint32_t ROOT_TAXON = 1;
+const uint32_t NO_TAXON = 0;
+const uint64 TAXON_SLOT_EMPTY = ~0ULL;  // canonical k-mers use at most 62 bits
+
+// Parent links read from "taxid<TAB>parent[<TAB>name]" lines; unknown taxa hang off the root
+struct Taxonomy {
+    unordered_map<uint32_t, uint32_t> parent;
+    unordered_map<uint32_t, string> names;
+
+    uint32_t parent_of(uint32_t t) const {
+        const auto it = parent.find(t);
+        return t == ROOT_TAXON || it == parent.end() ? ROOT_TAXON : it->second;
+    }
+    size_t depth(uint32_t t) const {
+        size_t d = 0;
+        for (; t != ROOT_TAXON; t = parent_of(t)) ++d;
+        return d;
+    }
+    uint32_t lca(uint32_t a, uint32_t b) const {
+        if (a == NO_TAXON) return b;
+        if (b == NO_TAXON) return a;
+        size_t da = depth(a), db = depth(b);
+        for (; da > db; --da) a = parent_of(a);
+        for (; db > da; --db) b = parent_of(b);
+        while (a != b) a = parent_of(a), b = parent_of(b);
+        return a;
+    }
+    bool within(uint32_t t, uint32_t ancestor) const {
+        for (;; t = parent_of(t)) {
+            if (t == ancestor) return true;
+            if (t == ROOT_TAXON) return false;
+        }
+    }
+    string name(uint32_t t) const {
+        const auto it = names.find(t);
+        return it == names.end() ? to_string(t) : it->second;
+    }
+};
+
+Taxonomy load_taxonomy(const string &path) {
+    Taxonomy tax;
+    tax.names[ROOT_TAXON] = "root";
+    if (path.empty()) return tax;
+    ifstream in(path);
+    if (!in) throw runtime_error("Cannot open " + path);
+    string line;
+    for (size_t line_no = 1; getline(in, line); ++line_no) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        uint32_t taxon = 0, parent = 0;
+        if (!(fields >> taxon >> parent) || taxon == NO_TAXON || parent == NO_TAXON) {
+            throw runtime_error(path + ":" + to_string(line_no) + ": expected 'taxid parent [name]'");
+        }
+        string name;
+        getline(fields, name);
+        if (taxon != ROOT_TAXON) tax.parent[taxon] = parent;
+        if (!trim(name).empty()) tax.names[taxon] = trim(name);
+    }
+    // every chain must reach the root
+    for (const auto &p : tax.parent) {
+        uint32_t t = p.first;
+        for (size_t steps = 0; t != ROOT_TAXON; t = tax.parent_of(t)) {
+            if (++steps > tax.parent.size()) throw runtime_error(path + ": cycle through taxon " + to_string(p.first));
+        }
+    }
+    return tax;
+}
+
+// "taxid=N" or "taxid|N" in a FASTA header
+uint32_t header_taxon(const NamedSequence &seq) {
+    const string header = seq.name + " " + seq.description;
+    const size_t at = header.find("taxid");
+    if (at == string::npos || at + 5 >= header.size() || (header[at + 5] != '=' && header[at + 5] != '|')) return NO_TAXON;
+    return static_cast<uint32_t>(strtoul(header.c_str() + at + 6, nullptr, 10));
+}
+
+// Calls fn(canonical k-mer) for each k-mer of seq (2-bit, A0 C1 G2 T3)
+template <class Fn>
+void for_each_canonical_kmer(const string &seq, unsigned k, Fn fn) {
+    const uint64 mask = (1ULL << (2 * k)) - 1;
+    uint64 fwd = 0, rev = 0;
+    size_t valid = 0;
+    for (const char c : seq) {
+        const int code = dna_to_code(c) - 1;
+        fwd = ((fwd << 2) | code) & mask;
+        rev = (rev >> 2) | (static_cast<uint64>(3 - code) << (2 * (k - 1)));
+        if (++valid >= k) fn(min(fwd, rev));
+    }
+}
+
+struct KmerTaxonTable {
+    unsigned k = CLASSIFY_K;
+    vector<uint64> kmers;
+    vector<uint32_t> taxa;
+    uint64 mask = 0;
+    SeededHash hash = new_hash_key();
+    size_t entries = 0;
+
+    size_t slot(uint64 kmer) const {
+        size_t i = hash(kmer) & mask;
+        while (kmers[i] != TAXON_SLOT_EMPTY && kmers[i] != kmer) i = (i + 1) & mask;
+        return i;
+    }
+    uint32_t find(uint64 kmer) const {
+        const size_t i = slot(kmer);
+        return kmers[i] == kmer ? taxa[i] : NO_TAXON;
+    }
+};
+
+// Sequences without a taxid in their header become their own taxon under the root
+KmerTaxonTable build_kmer_taxon_table(const vector<NamedSequence> &refs, Taxonomy &tax, unsigned k) {
+    KmerTaxonTable table;
+    table.k = k;
+    size_t total = 0;
+    for (const NamedSequence &r : refs) total += r.seq.size();
+    size_t capacity = 1024;
+    while (capacity * 7 < total * 10) capacity <<= 1;  // load factor at most 0.7
+    table.kmers.assign(capacity, TAXON_SLOT_EMPTY);
+    table.taxa.assign(capacity, NO_TAXON);
+    table.mask = capacity - 1;
+
+    uint32_t next_synthetic = 0x80000000u;
+    for (const NamedSequence &r : refs) {
+        uint32_t taxon = header_taxon(r);
+        if (taxon == NO_TAXON) {
+            taxon = next_synthetic++;
+            tax.names[taxon] = r.name;
+        }
+        for_each_canonical_kmer(r.seq, k, [&](uint64 kmer) {
+            const size_t i = table.slot(kmer);
+            if (table.kmers[i] == kmer) {
+                table.taxa[i] = tax.lca(table.taxa[i], taxon);
+            } else {
+                table.kmers[i] = kmer;
+                table.taxa[i] = taxon;
+                ++table.entries;
+            }
+        });
+    }
+    return table;
+}
+
+struct ReadClassification {
+    uint32_t taxon = NO_TAXON;
+    size_t hits = 0;   // k-mers found in the table
+    size_t kmers = 0;
+};
+
+ReadClassification classify_read(const KmerTaxonTable &table, const Taxonomy &tax, const string &seq) {
+    ReadClassification result;
+    unordered_map<uint32_t, size_t> counts;
+    for_each_canonical_kmer(seq, table.k, [&](uint64 kmer) {
+        ++result.kmers;
+        const uint32_t taxon = table.find(kmer);
+        if (taxon == NO_TAXON) return;
+        ++result.hits;
+        ++counts[taxon];
+    });
+    size_t best = 0;
+    for (const auto &candidate : counts) {
+        size_t score = 0;
+        for (const auto &c : counts) {
+            if (tax.within(candidate.first, c.first)) score += c.second;
+        }
+        if (score > best) {
+            best = score;
+            result.taxon = candidate.first;
+        } else if (score == best) {
+            result.taxon = tax.lca(result.taxon, candidate.first);
+        }
+    }
+    return result;
+}
+
+vector<ReadClassification> classify_reads(const string &db_path, Taxonomy &tax, const vector<NamedSequence> &reads,
+                                          unsigned k, unsigned threads) {
+    if (k < 1 || k > 31) throw runtime_error("Classification k must be between 1 and 31");
+    const vector<NamedSequence> refs = read_sequences(db_path);
+    if (refs.empty()) throw runtime_error("No sequence in " + db_path);
+    const KmerTaxonTable table = build_kmer_taxon_table(refs, tax, k);
+    cerr << "Classification table: " << table.entries << " " << k << "-mers from " << refs.size() << " sequences\n";
+    vector<ReadClassification> results(reads.size());
+    parallel_dispatch(reads.size(), threads, 64, [&](unsigned, size_t id) {
+        results[id] = classify_read(table, tax, reads[id].seq);
+    });
+    return results;
+}
+
+void run_classification(const string &db_path, const string &taxonomy_path, const string &reads_path,
+                        unsigned k, unsigned threads) {
+    Taxonomy tax = load_taxonomy(taxonomy_path);
+    const vector<NamedSequence> reads = read_sequences(reads_path);
+    const vector<ReadClassification> results = classify_reads(db_path, tax, reads, k, threads);
+    size_t classified = 0;
+    cout << "read\tstatus\ttaxon\tname\thit_kmers\tkmers\n";
+    for (size_t i = 0; i < reads.size(); ++i) {
+        const ReadClassification &r = results[i];
+        const bool hit = r.taxon != NO_TAXON;
+        classified += hit;
+        cout << reads[i].name << '\t' << (hit ? 'C' : 'U') << '\t' << (hit && r.taxon < 0x80000000u ? to_string(r.taxon) : "-")
+             << '\t' << (hit ? tax.name(r.taxon) : "-") << '\t' << r.hits << '\t' << r.kmers << '\n';
+    }
+    cerr << "Classified " << classified << " of " << reads.size() << " reads\n";
+}
+
+// Adapter trimming: when the insert is shorter than the read, the read runs into
+// the sequencing adapter and the tail would only produce spurious segments. The
+// parser cuts each read at the leftmost position whose suffix matches a prefix
+// of an adapter (or the whole adapter) with at most 10% mismatches, counting
+// mismatches eight bytes per step.
+const size_t MIN_ADAPTER_OVERLAP = 5;
+const double ADAPTER_ERROR_RATE = 0.1;
+
+const vector<NamedSequence> DEFAULT_ADAPTERS = {
+    {"truseq", "AGATCGGAAGAGC", ""},
+    {"nextera", "CTGTCTCTTATACACATCT", ""},
+    {"small_rna", "TGGAATTCTCGGGTGCCAAGG", ""},
+};
+
+// Mismatches between a[0..n) and b[0..n); stops early once past limit
+size_t count_mismatches(const char *a, const char *b, size_t n, size_t limit) {
+    size_t mismatches = 0, i = 0;
+    for (; i + 8 <= n && mismatches <= limit; i += 8) {
+        uint64 x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        x ^= y;
+        // fold each byte onto its low bit: one bit per differing byte
+        x |= x >> 4;
+        x |= x >> 2;
+        x |= x >> 1;
+        mismatches += __builtin_popcountll(x & 0x0101010101010101ULL);
+    }
+    for (; i < n && mismatches <= limit; ++i) mismatches += a[i] != b[i];
+    return mismatches;
+}
+
+struct AdapterTrimmer {
+    vector<NamedSequence> adapters = DEFAULT_ADAPTERS;
+    vector<size_t> hits = vector<size_t>(DEFAULT_ADAPTERS.size());
+    size_t reads = 0;
+    size_t trimmed_reads = 0;
+    size_t trimmed_bases = 0;
+    size_t dropped = 0;  // nothing but adapter
+
+    // Cuts the adapter tail off read; false when no bases remain
+    bool trim(NamedSequence &read) {
+        ++reads;
+        const size_t n = read.seq.size();
+        for (size_t p = 0; p + MIN_ADAPTER_OVERLAP <= n; ++p) {
+            for (size_t a = 0; a < adapters.size(); ++a) {
+                const size_t overlap = min(n - p, adapters[a].seq.size());
+                if (overlap < MIN_ADAPTER_OVERLAP) continue;
+                const size_t limit = static_cast<size_t>(overlap * ADAPTER_ERROR_RATE);
+                if (count_mismatches(read.seq.data() + p, adapters[a].seq.data(), overlap, limit) > limit) continue;
+                ++hits[a];
+                ++trimmed_reads;
+                trimmed_bases += n - p;
+                read.seq.resize(p);
+                if (p == 0) ++dropped;
+                return p > 0;
+            }
+        }
+        return true;
+    }
+
+    void report() const {
+        cerr << "Adapter trimming: " << trimmed_reads << " of " << reads << " reads trimmed, " << trimmed_bases
+             << " bases removed, " << dropped << " reads dropped as adapter only";
+        for (size_t a = 0; a < adapters.size(); ++a) {
+            if (hits[a]) cerr << (a ? ", " : " (") << adapters[a].name << ": " << hits[a];
+        }
+        cerr << (trimmed_reads ? ")\n" : "\n");
+    }
+};
+
+AdapterTrimmer load_adapters(const string &path) {
+    AdapterTrimmer trimmer;
+    if (path.empty()) return trimmer;
+    trimmer.adapters = read_sequences(path);
+    if (trimmer.adapters.empty()) throw runtime_error("No adapter sequence in " + path);
+    trimmer.hits.assign(trimmer.adapters.size(), 0);
+    return trimmer;
+}
+
+// Barcode demultiplexing: every read starts with a sample barcode. All barcodes
+// and their Hamming-distance-1 neighbours go into a perfect hash table (hash and
+// displace: one displacement per bucket chosen so that no two keys share a
+// slot), so assigning a read is two hashes and one comparison. The lookup runs
+// inside the FASTA parser, which hands each read, barcode removed, straight to
+// its sample's batch.
+const uint32_t BARCODE_AMBIGUOUS = numeric_limits<uint32_t>::max();  // neighbour of two barcodes
+const uint32_t BARCODE_UNKNOWN = BARCODE_AMBIGUOUS - 1;
+const uint32_t MAX_DISPLACEMENT = 1 << 20;
+
+struct BarcodeTable {
+    size_t length = 0;
+    vector<string> samples;
+    uint64 seed = 0;
+    vector<uint32_t> displacement;  // per bucket
+    vector<uint64> keys;            // 2-bit packed barcodes, ~0 when free
+    vector<uint32_t> values;        // sample index or BARCODE_AMBIGUOUS
+    uint64 mask = 0;
+
+    size_t bucket(uint64 key) const { return splitmix64(key ^ seed) % displacement.size(); }
+    size_t slot(uint64 key, uint32_t d) const { return splitmix64(key ^ seed ^ (static_cast<uint64>(d) << 32 | d)) & mask; }
+
+    uint32_t lookup(const string &read) const {
+        if (read.size() < length) return BARCODE_UNKNOWN;
+        uint64 key = 0;
+        for (size_t i = 0; i < length; ++i) key = key << 2 | (dna_to_code(read[i]) - 1);
+        const size_t s = slot(key, displacement[bucket(key)]);
+        return keys[s] == key ? values[s] : BARCODE_UNKNOWN;
+    }
+};
+
+// Hash and displace over the (key, sample) pairs; reseeds if a bucket cannot be placed
+void build_barcode_hash(BarcodeTable &table, const unordered_map<uint64, uint32_t> &entries) {
+    size_t capacity = 16;
+    while (capacity < 2 * entries.size()) capacity <<= 1;
+    for (uint64 attempt = 0;; ++attempt) {
+        table.seed = splitmix64(hash_run_seed ^ attempt);
+        table.displacement.assign(entries.size() / 4 + 1, 0);
+        table.keys.assign(capacity, ~0ULL);
+        table.values.assign(capacity, BARCODE_UNKNOWN);
+        table.mask = capacity - 1;
+        vector<vector<pair<uint64, uint32_t>>> buckets(table.displacement.size());
+        for (const auto &e : entries) buckets[table.bucket(e.first)].push_back(e);
+        vector<size_t> order(buckets.size());
+        for (size_t b = 0; b < order.size(); ++b) order[b] = b;
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+        bool placed_all = true;
+        for (const size_t b : order) {
+            if (buckets[b].empty()) break;
+            bool placed = false;
+            for (uint32_t d = 0; d < MAX_DISPLACEMENT && !placed; ++d) {
+                vector<size_t> slots;
+                for (const auto &e : buckets[b]) {
+                    const size_t s = table.slot(e.first, d);
+                    if (table.keys[s] != ~0ULL || find(slots.begin(), slots.end(), s) != slots.end()) break;
+                    slots.push_back(s);
+                }
+                if (slots.size() != buckets[b].size()) continue;
+                for (size_t i = 0; i < slots.size(); ++i) {
+                    table.keys[slots[i]] = buckets[b][i].first;
+                    table.values[slots[i]] = buckets[b][i].second;
+                }
+                table.displacement[b] = d;
+                placed = true;
+            }
+            if (!placed) {
+                placed_all = false;
+                break;
+            }
+        }
+        if (placed_all) return;
+    }
+}
+
+// "sample<TAB>barcode" per line; all barcodes must have the same length (at most 32)
+BarcodeTable load_barcodes(const string &path) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Cannot open " + path);
+    BarcodeTable table;
+    unordered_map<uint64, uint32_t> entries;
+    size_t ambiguous = 0;
+    unordered_map<uint64, uint32_t> exact;
+    auto add = [&](uint64 key, uint32_t sample) {
+        if (const auto it = exact.find(key); it != exact.end() && it->second != sample) {
+            throw runtime_error(path + ": samples " + table.samples[it->second] + " and " +
+                                table.samples[sample] + " have barcodes within distance 1");
+        }
+        const auto ins = entries.emplace(key, sample);
+        if (ins.second || ins.first->second == sample) return;
+        if (ins.first->second != BARCODE_AMBIGUOUS) ++ambiguous;
+        ins.first->second = BARCODE_AMBIGUOUS;
+    };
+    vector<pair<string, uint32_t>> barcodes;
+    string line;
+    for (size_t line_no = 1; getline(in, line); ++line_no) {
+        line = trim(line);
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        string sample, barcode;
+        if (!(fields >> sample >> barcode)) throw runtime_error(path + ":" + to_string(line_no) + ": expected 'sample barcode'");
+        to_upper(barcode);
+        validate_dna(barcode, "Barcode of " + sample);
+        if (!table.length) table.length = barcode.size();
+        if (barcode.size() != table.length || table.length > 32) {
+            throw runtime_error(path + ":" + to_string(line_no) + ": barcodes must share one length of at most 32");
+        }
+        barcodes.push_back({barcode, static_cast<uint32_t>(table.samples.size())});
+        table.samples.push_back(sample);
+    }
+    if (barcodes.empty()) throw runtime_error("No barcodes in " + path);
+    auto pack = [](const string &barcode) {
+        uint64 key = 0;
+        for (const char c : barcode) key = key << 2 | (dna_to_code(c) - 1);
+        return key;
+    };
+    for (const auto &b : barcodes) {
+        if (!exact.emplace(pack(b.first), b.second).second) {
+            throw runtime_error(path + ": barcode " + b.first + " is listed twice");
+        }
+    }
+    for (const auto &b : barcodes) {
+        const uint64 key = pack(b.first);
+        for (unsigned shift = 0; shift < 2 * table.length; shift += 2) {
+            for (uint64 code = 0; code < 4; ++code) add((key & ~(3ULL << shift)) | code << shift, b.second);
+        }
+    }
+    if (ambiguous) cerr << "Warning: " << ambiguous << " one-mismatch barcodes are shared by two samples and rejected\n";
+    build_barcode_hash(table, entries);
+    return table;
+}
+
+struct DemuxedReads {
+    vector<vector<NamedSequence>> batches;  // per sample, barcode removed
+    size_t unassigned = 0;
+    size_t ambiguous = 0;
+};
+
+// keep runs on every assigned read after its barcode is removed and may drop it
+DemuxedReads demultiplex_reads(const string &path, const BarcodeTable &table,
+                               const function<bool(NamedSequence &)> &keep) {
+    DemuxedReads out;
+    out.batches.resize(table.samples.size());
+    for_each_sequence(path, [&](NamedSequence &&read) {
+        const uint32_t sample = table.lookup(read.seq);
+        if (sample == BARCODE_UNKNOWN || read.seq.size() == table.length) {  // nothing left to align
+            ++out.unassigned;
+        } else if (sample == BARCODE_AMBIGUOUS) {
+            ++out.ambiguous;
+        } else {
+            read.seq.erase(0, table.length);
+            if (keep(read)) out.batches[sample].push_back(move(read));
+        }
+    });
+    return out;
+}
+
+struct BatchOptions {
+    bool use_fast_path = true;
+    bool use_mum = false;
+    size_t mum_len = MIN_MUM_LEN;
+    size_t anchor_len = MIN_ANCHOR_LEN;
+    unsigned threads = 1;
+    size_t dispatch_batch = 1;  // queries a worker claims at a time
+    vector<RefRegion> regions;  // restrict matches to these reference intervals
+    string index_path;          // mmap a saved index instead of building one
+    bool lock_index = false;
+    bool bisulfite = false;  // C->T converted matching
+    bool spliced = false;    // chain exact segments across introns
+    string classify_db;      // align only reads this collection classifies under taxon
+    string taxonomy_path;
+    uint32_t taxon = NO_TAXON;
+    unsigned classify_k = CLASSIFY_K;
+    string barcodes_path;    // split reads into per-sample batches by barcode first
+    bool trim_adapters = false;
+    string adapters_path;    // adapter FASTA instead of the built-in set
+    string variants_path;    // align against the reference + known variants graph
+    string binary_path;  // columnar output instead of TSV when set
+    bool reorder = false;    // dispatch queries grouped by minimizer
+    bool strand_vote = false;  // search only the strand sampled k-mers agree on
+};
+
+template <class Index>
+vector<MatchSegment> align_batch_query(string_view query, const string &ref,
+                                       const Index &ref_map, const BatchOptions &opt) {
+    if (opt.use_mum) return align_by_mums(string(query), ref, opt.mum_len);
+    auto align_window = [&](string_view window) {
+        // bisulfite conversion differs between the strands, so both are searched
+        const int strand = opt.strand_vote && !opt.bisulfite ? vote_strand(window, ref_map) : 0;
+        auto segments = strand ? segment_one_strand(window, ref_map, strand < 0)
+                               : reconstruct_path(find_optimal_path(window, ref_map), window.size());
+        if (verify_segments(window, ref, segments, opt.bisulfite)) return segments;
+        RefMap fresh = build_reference_index(ref, opt.regions, opt.bisulfite);  // the shared index is read-only here
+        return segment_verified(window, ref, fresh, opt.regions);
+    };
+    return opt.use_fast_path ? align_with_fast_path(query, ref, opt.anchor_len, opt.regions, align_window)
+                             : align_window(query);
+}
+
+// Locality-aware dispatch: queries are aligned in order of their minimizer (the
+// smallest hashed canonical k-mer of the read), so reads from the same reference
+// neighbourhood run back to back and find its index entries still cached.
+// Results stay indexed by query, so output order is unchanged.
+const unsigned REORDER_K = 15;
+
+vector<size_t> locality_order(const vector<NamedSequence> &queries, unsigned threads) {
+    vector<uint64> minimizer(queries.size(), numeric_limits<uint64>::max());
+    parallel_dispatch(queries.size(), threads, 64, [&](unsigned, size_t id) {
+        try {
+            for_each_canonical_kmer(queries[id].seq, REORDER_K,
+                                    [&](uint64 kmer) { minimizer[id] = min(minimizer[id], splitmix64(kmer)); });
+        } catch (const exception &) {
+            // invalid reads fail in alignment, wherever they are placed
+        }
+    });
+    vector<size_t> order(queries.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return minimizer[a] < minimizer[b]; });
+    return order;
+}
+
+void run_batch(const string &ref_path, const string &queries_path, const BatchOptions &opt) {
+    const vector<NamedSequence> refs = read_sequences(ref_path);
+    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+    const string &ref = refs[0].seq;
+    vector<NamedSequence> queries;
+    vector<string> sample_of;  // per query when demultiplexing
+    AdapterTrimmer trimmer = load_adapters(opt.adapters_path);
+    auto keep = [&](NamedSequence &read) { return !opt.trim_adapters || trimmer.trim(read); };
+    if (opt.barcodes_path.empty()) {
+        for_each_sequence(queries_path, [&](NamedSequence &&read) {
+            if (keep(read)) queries.push_back(move(read));
+        });
+    } else {
+        const BarcodeTable barcodes = load_barcodes(opt.barcodes_path);
+        DemuxedReads demux = demultiplex_reads(queries_path, barcodes, keep);
+        for (size_t s = 0; s < demux.batches.size(); ++s) {
+            cerr << "Sample " << barcodes.samples[s] << ": " << demux.batches[s].size() << " reads (first id "
+                 << queries.size() << ")\n";
+            for (NamedSequence &read : demux.batches[s]) {
+                queries.push_back(move(read));
+                sample_of.push_back(barcodes.samples[s]);
+            }
+        }
+        cerr << "Unassigned reads: " << demux.unassigned << ", ambiguous barcodes: " << demux.ambiguous << "\n";
+    }
+    if (opt.trim_adapters) trimmer.report();
+    BatchOptions options = opt;
+    options.regions = normalize_regions(opt.regions, ref.size());
+    if (options.use_mum) options.mum_len = select_mum_length(ref, options.threads);
+
+    FlatRefTable flat;
+    unique_ptr<MappedIndex> mapped;
+    UniqueKmerIndex kmer_index;
+    vector<Variant> variants;
+    GraphIndex graph;
+    if (!opt.variants_path.empty()) {
+        variants = read_variants(opt.variants_path, ref);
+        graph = build_graph_index(ref, variants);
+        cerr << "Variation graph: " << variants.size() << " variants, " << graph.paths.size() << " alt paths, "
+             << graph.alt_map.size() << " alt substrings\n";
+    } else if (!opt.index_path.empty()) {
+        mapped = open_reference_index(opt.index_path, ref, opt.threads, opt.lock_index);
+    } else if (opt.spliced) {
+        kmer_index = build_spliced_index(ref, opt.threads, options.regions);
+    } else if (!opt.use_mum) {
+        flat = build_flat_reference_index(ref, options.regions, options.bisulfite, opt.threads);
+    }
+    auto align = [&](const string &query) {
+        if (opt.spliced) return align_spliced(query, ref, kmer_index);
+        if (!opt.variants_path.empty()) return align_graph_query(query, ref, graph, variants);
+        return align_batch_query(query, ref, mapped ? mapped->view : flat.view, options);
+    };
+
+    ColumnarWriter writer;
+    if (!opt.binary_path.empty()) open_columnar_writer(writer, opt.binary_path);
+    vector<vector<MatchSegment>> text_results(opt.binary_path.empty() ? queries.size() : 0);
+    vector<string> errors(queries.size());
+
+    vector<char> selected;
+    if (!opt.classify_db.empty()) {
+        Taxonomy tax = load_taxonomy(opt.taxonomy_path);
+        const vector<ReadClassification> classes = classify_reads(opt.classify_db, tax, queries, opt.classify_k, opt.threads);
+        for (const ReadClassification &c : classes) selected.push_back(c.taxon != NO_TAXON && tax.within(c.taxon, opt.taxon));
+        cerr << "Aligning " << count(selected.begin(), selected.end(), 1) << " of " << queries.size()
+             << " reads classified under taxon " << tax.name(opt.taxon) << "\n";
+    }
+
+    vector<ColumnBuffer> buffers(max(1u, opt.threads));
+    const vector<size_t> order = opt.reorder ? locality_order(queries, opt.threads) : vector<size_t>{};
+    parallel_dispatch(queries.size(), opt.threads, opt.dispatch_batch, [&](unsigned w, size_t i) {
+        const size_t id = order.empty() ? i : order[i];
+        if (!selected.empty() && !selected[id]) return;
+        try {
+            vector<MatchSegment> segments = align(queries[id].seq);
+            if (opt.binary_path.empty()) {
+                text_results[id] = move(segments);
+                return;
+            }
+            for (const MatchSegment &seg : segments) buffers[w].append(static_cast<uint32_t>(id), seg);
+            if (buffers[w].rows() >= COLUMNAR_BATCH_ROWS) flush_column_buffer(writer, buffers[w]);
+        } catch (const exception &e) {
+            errors[id] = e.what();
+        }
+    });
+    if (!opt.binary_path.empty()) {
+        for (ColumnBuffer &buf : buffers) flush_column_buffer(writer, buf);
+    }
+
+    for (size_t id = 0; id < queries.size(); ++id) {
+        if (!errors[id].empty()) cerr << "\033[31mError: " << queries[id].name << ": " << errors[id] << "\033[0m\n";
+    }
+    if (!opt.binary_path.empty()) {
+        cerr << "Wrote " << writer.rows << " segments in " << writer.batches << " record batches to "
+             << opt.binary_path << "\n";
+        return;
+    }
+    const bool graph_mode = !opt.variants_path.empty();
+    cout << (sample_of.empty() ? "" : "sample\t") << "query\tquery_start\tquery_end\tref_start\tref_end\tstrand"
+         << (graph_mode ? "\talleles\n" : "\n");
+    for (size_t id = 0; id < queries.size(); ++id) {
+        for (const MatchSegment &seg : text_results[id]) {
+            if (!sample_of.empty()) cout << sample_of[id] << '\t';
+            cout << queries[id].name << '\t' << seg.query_start << '\t' << seg.query_end << '\t'
+                 << seg.ref_info.start << '\t' << seg.ref_info.end << '\t'
+                 << (seg.ref_info.reverse ? '-' : '+');
+            if (graph_mode) {
+                const string alleles = graph_segment_alleles(queries[id].seq, graph, variants, seg);
+                cout << '\t' << (alleles.empty() ? "-" : alleles);
+            }
+            cout << '\n';
+        }
+    }
+}
+
+// Server mode: the reference index is built once and queries arrive over a Unix
+// socket, one request per line:
+//   ALIGN <id> <interactive|batch> <sequence>  ->  <id> OK <n> <qs>-<qe>:<rs>-<re>:<strand> ...
+//                                               or <id> BUSY <queued bases>   (rejected, retry later)
+//                                               or <id> ERR <message>
+//   STATS                                      ->  STATS <class> queued=.. done=.. rejected=.. p50_ms=.. p99_ms=.. ...
+//   SHUTDOWN                                   ->  stops the server
+// Each priority class has its own queue; workers pick the non-empty class with
+// the smallest virtual time, which advances by query length over the class
+// weight, so batch jobs cannot starve interactive ones. A class whose queued
+// bases would exceed its bound is refused with BUSY instead of queueing.
+enum RequestClass { INTERACTIVE = 0, BATCH = 1, REQUEST_CLASSES = 2 };
+const char *const REQUEST_CLASS_NAMES[REQUEST_CLASSES] = {"interactive", "batch"};
+const double REQUEST_CLASS_WEIGHT[REQUEST_CLASSES] = {8.0, 1.0};
+const size_t DEFAULT_MAX_QUEUED_BASES = 50000000;  // batch bound; interactive gets a tenth
+const size_t LATENCY_SAMPLES = 10000;
+
+#ifdef __linux__  // Unix sockets, POSIX shared memory and futexes
+struct ServeConnection {
+    int fd;
+    mutex write_lock;
+    explicit ServeConnection(int socket) : fd(socket) {}
+    ~ServeConnection() { close(fd); }
+    void send(const string &line) {
+        lock_guard<mutex> lock(write_lock);
+        for (size_t off = 0; off < line.size();) {
+            const ssize_t n = ::send(fd, line.data() + off, line.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) return;  // client went away
+            off += n;
+        }
+    }
+};
+
+// Shared-memory transport for clients on the same host. The client creates a
+// POSIX shared memory object laid out as RingHeader, the request ring and the
+// response ring, and sends "ATTACH <name>" on the socket. Requests are records
+// (RingRecord header, then the uppercase query padded to 8 bytes) that workers
+// align in place from the mapping; the request slot is released once every
+// earlier record has been answered. Responses carry RingSegment arrays (or an
+// error message). A record that would cross the ring end is preceded by a wrap
+// marker; each side sleeps on a futex counter the other side bumps.
+const char RING_MAGIC[8] = {'D', 'N', 'A', 'R', 'I', 'N', 'G', '1'};
+const uint32_t RING_WRAP = numeric_limits<uint32_t>::max();
+const int RING_POLL_MS = 100;  // futex timeout, to notice a client that went away
+enum RingStatus : uint32_t { RING_OK = 0, RING_BUSY = 1, RING_ERROR = 2 };
+
+struct RingHeader {
+    char magic[8];
+    uint64 request_capacity;   // bytes, multiple of 8
+    uint64 response_capacity;
+    atomic<uint32_t> closed;   // set by the client when it detaches
+    alignas(64) atomic<uint64> request_head;   // written by the client
+    atomic<uint32_t> request_posted;           // futex, bumped after each request
+    alignas(64) atomic<uint64> request_tail;   // released by the server
+    atomic<uint32_t> request_freed;
+    alignas(64) atomic<uint64> response_head;  // written by the server
+    atomic<uint32_t> response_posted;
+    alignas(64) atomic<uint64> response_tail;  // released by the client
+    atomic<uint32_t> response_freed;
+};
+static_assert(atomic<uint64>::is_always_lock_free && atomic<uint32_t>::is_always_lock_free,
+              "ring cursors are shared between processes");
+
+struct RingRecord {
+    uint32_t len;   // payload bytes, or RING_WRAP
+    uint32_t kind;  // RequestClass in requests, RingStatus in responses
+    uint64 id;
+};
+
+struct RingSegment {
+    uint64 query_start;
+    uint64 query_end;
+    uint64 ref_start;
+    uint64 ref_end;
+    uint64 reverse;
+};
+
+uint64 ring_record_size(uint64 payload) {
+    return sizeof(RingRecord) + ((payload + 7) & ~7ULL);
+}
+
+void futex_wait(atomic<uint32_t> &word, uint32_t seen, int timeout_ms) {
+    timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, seen, &timeout, nullptr, 0);
+}
+
+void futex_bump(atomic<uint32_t> &word) {
+    word.fetch_add(1, memory_order_release);
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+// Offset for a record of `size` bytes at head, writing a wrap marker and
+// skipping to the ring start if it would cross the end; false when full
+bool ring_reserve(char *data, uint64 capacity, uint64 &head, uint64 tail, uint64 size) {
+    const uint64 to_end = capacity - head % capacity;
+    const uint64 skip = to_end < size ? to_end : 0;
+    if (head + skip + size - tail > capacity) return false;
+    if (skip) {
+        if (skip >= sizeof(RingRecord)) {
+            const RingRecord wrap{RING_WRAP, 0, 0};
+            memcpy(data + head % capacity, &wrap, sizeof wrap);
+        }
+        head += skip;
+    }
+    return true;
+}
+
+// Record at pos, stepping over wrap markers; nullptr when pos reaches head
+const RingRecord *ring_record_at(const char *data, uint64 capacity, uint64 &pos, uint64 head) {
+    while (pos < head) {
+        const uint64 to_end = capacity - pos % capacity;
+        const RingRecord *rec = reinterpret_cast<const RingRecord *>(data + pos % capacity);
+        if (to_end < sizeof(RingRecord) || rec->len == RING_WRAP) {
+            pos += to_end;
+            continue;
+        }
+        return rec;
+    }
+    return nullptr;
+}
+
+// Server side of one attached client
+struct RingAttachment {
+    void *addr = nullptr;
+    size_t size = 0;
+    RingHeader *header = nullptr;
+    char *requests = nullptr;
+    char *responses = nullptr;
+    mutex lock;
+    deque<pair<uint64, bool>> in_flight;  // (record end, answered), in ring order
+    uint64 first_seq = 0;                 // sequence number of in_flight.front()
+
+    ~RingAttachment() {
+        if (addr) munmap(addr, size);
+    }
+
+    // Writes the response, then releases every leading answered request
+    void respond(uint64 seq, uint64 id, RingStatus status, const vector<MatchSegment> &segments, string error) {
+        uint64 payload = status == RING_OK ? segments.size() * sizeof(RingSegment) : error.size();
+        if (ring_record_size(payload) > header->response_capacity / 2) {
+            status = RING_ERROR;
+            error = "result does not fit the response ring";
+            payload = error.size();
+        }
+        const uint64 record = ring_record_size(payload);
+        unique_lock<mutex> guard(lock);
+        uint64 head = header->response_head.load(memory_order_relaxed);
+        for (;;) {
+            const uint32_t seen = header->response_freed.load(memory_order_acquire);
+            uint64 h = head;
+            if (ring_reserve(responses, header->response_capacity, h, header->response_tail.load(memory_order_acquire), record)) {
+                head = h;
+                break;
+            }
+            if (header->closed.load()) return;
+            guard.unlock();
+            futex_wait(header->response_freed, seen, RING_POLL_MS);
+            guard.lock();
+            head = header->response_head.load(memory_order_relaxed);
+        }
+        char *at = responses + head % header->response_capacity;
+        const RingRecord rec{static_cast<uint32_t>(payload), status, id};
+        memcpy(at, &rec, sizeof rec);
+        if (status == RING_OK) {
+            RingSegment *out = reinterpret_cast<RingSegment *>(at + sizeof rec);
+            for (size_t i = 0; i < segments.size(); ++i) {
+                const MatchSegment &s = segments[i];
+                out[i] = {s.query_start, s.query_end, s.ref_info.start, s.ref_info.end, s.ref_info.reverse};
+            }
+        } else {
+            memcpy(at + sizeof rec, error.data(), error.size());
+        }
+        header->response_head.store(head + record, memory_order_release);
+        futex_bump(header->response_posted);
+
+        in_flight[seq - first_seq].second = true;
+        bool freed = false;
+        while (!in_flight.empty() && in_flight.front().second) {
+            header->request_tail.store(in_flight.front().first, memory_order_release);
+            in_flight.pop_front();
+            ++first_seq;
+            freed = true;
+        }
+        if (freed) futex_bump(header->request_freed);
+    }
+};
+
+shared_ptr<RingAttachment> attach_ring(const string &name) {
+    const int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) throw runtime_error("Cannot open shared memory " + name + ": " + strerror(errno));
+    struct stat st;
+    auto ring = make_shared<RingAttachment>();
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(RingHeader)) {
+        ring->size = st.st_size;
+        ring->addr = mmap(nullptr, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (!ring->addr || ring->addr == MAP_FAILED) {
+        ring->addr = nullptr;
+        throw runtime_error("Cannot map shared memory " + name);
+    }
+    ring->header = static_cast<RingHeader *>(ring->addr);
+    const RingHeader &h = *ring->header;
+    if (memcmp(h.magic, RING_MAGIC, 8) != 0 || h.request_capacity % 8 || h.response_capacity % 8 ||
+        sizeof(RingHeader) + h.request_capacity + h.response_capacity > ring->size) {
+        throw runtime_error("Shared memory " + name + " is not a request/response ring");
+    }
+    ring->requests = static_cast<char *>(ring->addr) + sizeof(RingHeader);
+    ring->responses = ring->requests + h.request_capacity;
+    return ring;
+}
+
+struct ServeJob {
+    shared_ptr<ServeConnection> conn;  // socket client, or
+    shared_ptr<RingAttachment> ring;   // shared-memory client
+    string id;                         // socket request id
+    uint64 ring_id = 0;
+    uint64 ring_seq = 0;               // position among the ring's requests
+    string text;                       // socket query
+    const char *data = nullptr;        // ring query, inside the client's mapping
+    size_t len = 0;
+    RequestClass cls = BATCH;
+    chrono::steady_clock::time_point enqueued;
+
+    string_view query() const { return data ? string_view(data, len) : string_view(text); }
+};
+
+struct FairScheduler {
+    mutex lock;
+    condition_variable ready;
+    deque<ServeJob> queues[REQUEST_CLASSES];
+    size_t queued_bases[REQUEST_CLASSES] = {0, 0};
+    size_t limit[REQUEST_CLASSES] = {0, 0};
+    double vtime[REQUEST_CLASSES] = {0, 0};
+    size_t done[REQUEST_CLASSES] = {0, 0};
+    size_t rejected[REQUEST_CLASSES] = {0, 0};
+    vector<double> latency_ms[REQUEST_CLASSES];  // ring of the last LATENCY_SAMPLES
+    bool stopping = false;
+
+    // false (and nothing queued) when the class is over its bound
+    bool admit(ServeJob &&job) {
+        lock_guard<mutex> guard(lock);
+        const RequestClass c = job.cls;
+        if (queued_bases[c] + job.query().size() > limit[c] && !queues[c].empty()) {
+            ++rejected[c];
+            return false;
+        }
+        if (queues[c].empty()) {
+            // an idle class resumes at the current virtual time instead of cashing in saved credit
+            const RequestClass other = c == INTERACTIVE ? BATCH : INTERACTIVE;
+            if (!queues[other].empty()) vtime[c] = max(vtime[c], vtime[other]);
+        }
+        queued_bases[c] += job.query().size();
+        job.enqueued = chrono::steady_clock::now();
+        queues[c].push_back(move(job));
+        ready.notify_one();
+        return true;
+    }
+
+    bool next(ServeJob &job) {
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard, [&] { return stopping || !queues[INTERACTIVE].empty() || !queues[BATCH].empty(); });
+        if (stopping) return false;
+        RequestClass c = queues[INTERACTIVE].empty() ? BATCH : INTERACTIVE;
+        if (!queues[INTERACTIVE].empty() && !queues[BATCH].empty() && vtime[BATCH] < vtime[INTERACTIVE]) c = BATCH;
+        job = move(queues[c].front());
+        queues[c].pop_front();
+        queued_bases[c] -= job.query().size();
+        vtime[c] += job.query().size() / REQUEST_CLASS_WEIGHT[c];
+        return true;
+    }
+
+    void finished(const ServeJob &job) {
+        const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - job.enqueued).count();
+        lock_guard<mutex> guard(lock);
+        vector<double> &samples = latency_ms[job.cls];
+        if (samples.size() < LATENCY_SAMPLES) samples.push_back(ms);
+        else samples[done[job.cls] % LATENCY_SAMPLES] = ms;
+        ++done[job.cls];
+    }
+
+    string stats() {
+        lock_guard<mutex> guard(lock);
+        ostringstream out;
+        out << "STATS";
+        for (int c = 0; c < REQUEST_CLASSES; ++c) {
+            vector<double> sorted = latency_ms[c];
+            sort(sorted.begin(), sorted.end());
+            auto pct = [&](double p) { return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))]; };
+            out << ' ' << REQUEST_CLASS_NAMES[c] << " queued=" << queues[c].size() << " done=" << done[c]
+                << " rejected=" << rejected[c] << fixed << setprecision(2) << " p50_ms=" << pct(0.5)
+                << " p99_ms=" << pct(0.99);
+        }
+        out << '\n';
+        return out.str();
+    }
+
+    void stop() {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        ready.notify_all();
+    }
+
+    // jobs still queued once the workers are gone
+    vector<ServeJob> drain() {
+        lock_guard<mutex> guard(lock);
+        vector<ServeJob> left;
+        for (int c = 0; c < REQUEST_CLASSES; ++c) {
+            for (ServeJob &job : queues[c]) left.push_back(move(job));
+            queues[c].clear();
+            queued_bases[c] = 0;
+        }
+        return left;
+    }
+};
+
+// Connection and ring threads run detached; run_server unblocks their reads at
+// shutdown and waits for every one to leave before the scheduler goes away
+struct ServeClients {
+    mutex lock;
+    condition_variable idle;
+    vector<int> fds;  // sockets of live connection threads
+    size_t threads = 0;
+
+    void enter(int fd) {
+        lock_guard<mutex> guard(lock);
+        ++threads;
+        if (fd >= 0) fds.push_back(fd);
+    }
+    void leave(int fd) {
+        lock_guard<mutex> guard(lock);
+        --threads;
+        if (fd >= 0) fds.erase(find(fds.begin(), fds.end(), fd));
+        idle.notify_all();
+    }
+    void close_all() {
+        unique_lock<mutex> guard(lock);
+        for (int fd : fds) shutdown(fd, SHUT_RD);  // replies can still be written
+        idle.wait(guard, [&] { return threads == 0; });
+    }
+};
+
+string format_serve_result(const string &id, const vector<MatchSegment> &segments) {
+    ostringstream out;
+    out << id << " OK " << segments.size();
+    for (const MatchSegment &seg : segments) {
+        out << ' ' << seg.query_start << '-' << seg.query_end << ':' << seg.ref_info.start << '-'
+            << seg.ref_info.end << ':' << (seg.ref_info.reverse ? '-' : '+');
+    }
+    out << '\n';
+    return out.str();
+}
+
+// Feeds the requests of an attached ring to the scheduler until the client detaches
+void serve_ring(shared_ptr<RingAttachment> ring, FairScheduler &scheduler) {
+    RingHeader &h = *ring->header;
+    uint64 next = h.request_tail.load(memory_order_acquire), seq = 0;
+    for (;;) {
+        const uint32_t seen = h.request_posted.load(memory_order_acquire);
+        const uint64 head = h.request_head.load(memory_order_acquire);
+        for (const RingRecord *rec; (rec = ring_record_at(ring->requests, h.request_capacity, next, head));) {
+            // the client can rewrite the record under us: read it once, and drop
+            // a ring whose record would reach past its slot
+            RingRecord record;
+            memcpy(&record, rec, sizeof record);
+            const uint64 size = ring_record_size(record.len);
+            if (record.len == RING_WRAP || size > h.request_capacity ||
+                next % h.request_capacity + size > h.request_capacity || next + size > head) {
+                cerr << "Ring request " << record.id << ": malformed record of " << record.len << " bytes, detaching\n";
+                h.closed.store(1);
+                return;
+            }
+            ServeJob job;
+            job.ring = ring;
+            job.ring_id = record.id;
+            job.ring_seq = seq++;
+            job.data = reinterpret_cast<const char *>(rec + 1);
+            job.len = record.len;
+            job.cls = record.kind == INTERACTIVE ? INTERACTIVE : BATCH;
+            next += size;
+            {
+                lock_guard<mutex> guard(ring->lock);
+                ring->in_flight.push_back({next, false});
+            }
+            const uint64 id = job.ring_id, job_seq = job.ring_seq;
+            if (!scheduler.admit(move(job))) ring->respond(job_seq, id, RING_BUSY, {}, "");
+        }
+        {
+            lock_guard<mutex> guard(scheduler.lock);
+            if (scheduler.stopping) return;
+        }
+        if (h.closed.load()) return;
+        if (next == h.request_head.load(memory_order_acquire)) futex_wait(h.request_posted, seen, RING_POLL_MS);
+    }
+}
+
+// Reads request lines from one client until it disconnects
+void serve_connection(shared_ptr<ServeConnection> conn, FairScheduler &scheduler, ServeClients &clients, int listen_fd) {
+    string pending;
+    char buf[65536];
+    for (ssize_t n; (n = read(conn->fd, buf, sizeof buf)) > 0;) {
+        pending.append(buf, n);
+        for (size_t nl; (nl = pending.find('\n')) != string::npos; pending.erase(0, nl + 1)) {
+            istringstream fields(pending.substr(0, nl));
+            string command, id, cls;
+            fields >> command;
+            if (command == "STATS") {
+                conn->send(scheduler.stats());
+            } else if (command == "SHUTDOWN") {
+                scheduler.stop();
+                shutdown(listen_fd, SHUT_RDWR);
+                return;
+            } else if (command == "ATTACH") {
+                string name;
+                fields >> name;
+                try {
+                    shared_ptr<RingAttachment> ring = attach_ring(name);
+                    clients.enter(-1);
+                    thread([ring, &scheduler, &clients] {
+                        serve_ring(ring, scheduler);
+                        clients.leave(-1);
+                    }).detach();
+                    conn->send("ATTACHED " + name + "\n");
+                } catch (const exception &e) {
+                    conn->send(string("- ERR ") + e.what() + "\n");
+                }
+            } else if (command == "ALIGN") {
+                ServeJob job;
+                fields >> id >> cls >> job.text;
+                to_upper(job.text);
+                if (job.text.empty() || (cls != "interactive" && cls != "batch")) {
+                    conn->send((id.empty() ? "-" : id) + " ERR expected ALIGN <id> <interactive|batch> <sequence>\n");
+                    continue;
+                }
+                job.conn = conn;
+                job.id = id;
+                job.cls = cls == "interactive" ? INTERACTIVE : BATCH;
+                const size_t len = job.text.size();
+                if (!scheduler.admit(move(job))) conn->send(id + " BUSY " + to_string(len) + "\n");
+            } else if (!command.empty()) {
+                conn->send("- ERR unknown command " + command + "\n");
+            }
+        }
+    }
+}
+
+void run_server(const string &ref_path, const string &socket_path, const BatchOptions &opt, size_t max_queued) {
+    const vector<NamedSequence> refs = read_sequences(ref_path);
+    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+    const string &ref = refs[0].seq;
+    BatchOptions options = opt;
+    options.regions = normalize_regions(opt.regions, ref.size());
+    if (options.use_mum) options.mum_len = select_mum_length(ref, options.threads);
+    const FlatRefTable index = build_flat_reference_index(ref, options.regions, options.bisulfite, opt.threads);
+
+    FairScheduler scheduler;
+    ServeClients clients;
+    scheduler.limit[BATCH] = max_queued;
+    scheduler.limit[INTERACTIVE] = max<size_t>(1, max_queued / 10);
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (listen_fd < 0 || socket_path.size() >= sizeof addr.sun_path) throw runtime_error("Cannot create socket " + socket_path);
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    unlink(socket_path.c_str());
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0 || listen(listen_fd, 64) != 0) {
+        throw runtime_error("Cannot listen on " + socket_path + ": " + strerror(errno));
+    }
+    cerr << "Serving " << refs[0].name << " (" << ref.size() << " bp) on " << socket_path << " with "
+         << max(1u, opt.threads) << " workers\n";
+
+    vector<thread> workers;
+    for (unsigned w = 0; w < max(1u, opt.threads); ++w) {
+        workers.emplace_back([&]() {
+            for (ServeJob job; scheduler.next(job);) {
+                vector<MatchSegment> segments;
+                string error;
+                try {
+                    const string_view query = job.query();
+                    if (query.find_first_not_of("ACGT") != string_view::npos) {
+                        throw runtime_error("Query contains invalid character. Only A/T/C/G allowed");
+                    }
+                    segments = align_batch_query(query, ref, index.view, options);
+                } catch (const exception &e) {
+                    error = e.what();
+                }
+                if (job.ring) {
+                    job.ring->respond(job.ring_seq, job.ring_id, error.empty() ? RING_OK : RING_ERROR, segments, error);
+                } else {
+                    job.conn->send(error.empty() ? format_serve_result(job.id, segments) : job.id + " ERR " + error + "\n");
+                }
+                scheduler.finished(job);
+                job = ServeJob{};
+            }
+        });
+    }
+    for (int fd; (fd = accept(listen_fd, nullptr, nullptr)) >= 0;) {
+        auto conn = make_shared<ServeConnection>(fd);
+        clients.enter(fd);
+        thread([conn, &scheduler, &clients, listen_fd] {
+            serve_connection(conn, scheduler, clients, listen_fd);
+            clients.leave(conn->fd);
+        }).detach();
+    }
+    scheduler.stop();
+    for (thread &t : workers) t.join();
+    clients.close_all();
+    for (const ServeJob &job : scheduler.drain()) {
+        if (job.ring) job.ring->respond(job.ring_seq, job.ring_id, RING_ERROR, {}, "server shutting down");
+        else job.conn->send(job.id + " ERR server shutting down\n");
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+}
+
+// Reference client: sends every query of a FASTA/FASTQ file to a running
+// server, over the socket or through a shared-memory ring, retries BUSY
+// answers and prints the same TSV as batch mode in input order.
+const uint64 CLIENT_RING_MIN_BYTES = 1 << 20;
+
+int connect_server(const string &socket_path) {
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (fd < 0 || socket_path.size() >= sizeof addr.sun_path) throw runtime_error("Cannot create socket " + socket_path);
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0) {
+        close(fd);
+        throw runtime_error("Cannot connect to " + socket_path + ": " + strerror(errno));
+    }
+    return fd;
+}
+
+bool read_reply_line(int fd, string &buffer, string &line) {
+    for (size_t nl; (nl = buffer.find('\n')) == string::npos;) {
+        char chunk[65536];
+        const ssize_t got = recv(fd, chunk, sizeof chunk, 0);
+        if (got <= 0) return false;
+        buffer.append(chunk, got);
+    }
+    const size_t nl = buffer.find('\n');
+    line = buffer.substr(0, nl);
+    buffer.erase(0, nl + 1);
+    return true;
+}
+
+void send_all(int fd, const string &text) {
+    for (size_t sent = 0; sent < text.size();) {
+        const ssize_t n = ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) throw runtime_error("Server closed the connection");
+        sent += n;
+    }
+}
+
+// In-flight requests grow by one per answer and halve on BUSY, so a loaded
+// server sees fewer retries instead of a resend storm
+struct ClientWindow {
+    deque<uint64> to_send;
+    size_t in_flight = 0;
+    size_t limit = 64;
+
+    bool can_send() const { return !to_send.empty() && in_flight < limit; }
+    void answered() {
+        --in_flight;
+        ++limit;
+    }
+    void busy(uint64 id) {
+        --in_flight;
+        limit = max<size_t>(1, limit / 2);
+        to_send.push_front(id);
+    }
+};
+
+// Answers of the socket protocol, indexed by query
+void client_over_socket(int fd, const vector<NamedSequence> &queries, RequestClass cls,
+                        vector<vector<MatchSegment>> &results, vector<string> &errors) {
+    const string prefix = string(" ") + REQUEST_CLASS_NAMES[cls] + ' ';
+    ClientWindow window;
+    for (size_t id = 0; id < queries.size(); ++id) window.to_send.push_back(id);
+    string buffer, line, request;
+    for (size_t pending = queries.size(); pending;) {
+        for (; window.can_send(); ++window.in_flight) {
+            const uint64 id = window.to_send.front();
+            window.to_send.pop_front();
+            request += "ALIGN " + to_string(id) + prefix + queries[id].seq + '\n';
+        }
+        send_all(fd, request);
+        request.clear();
+        if (!read_reply_line(fd, buffer, line)) throw runtime_error("Server closed the connection");
+        istringstream fields(line);
+        size_t id = 0, count = 0;
+        string status;
+        fields >> id >> status;
+        if (id >= queries.size()) throw runtime_error("Unexpected reply: " + line);
+        if (status == "BUSY") {
+            window.busy(id);
+            continue;
+        }
+        window.answered();
+        --pending;
+        if (status != "OK") {
+            getline(fields >> ws, errors[id]);
+            continue;
+        }
+        fields >> count;
+        for (string seg; count-- && fields >> seg;) {
+            MatchSegment m;
+            char sep, strand = '+';
+            istringstream(seg) >> m.query_start >> sep >> m.query_end >> sep >> m.ref_info.start >> sep
+                               >> m.ref_info.end >> sep >> strand;
+            m.ref_info.reverse = strand == '-';
+            results[id].push_back(m);
+        }
+    }
+}
+
+// Same, through a ring the client creates, announces and unlinks
+void client_over_ring(int fd, const vector<NamedSequence> &queries, RequestClass cls,
+                      vector<vector<MatchSegment>> &results, vector<string> &errors) {
+    uint64 capacity = CLIENT_RING_MIN_BYTES;
+    for (const NamedSequence &q : queries) capacity = max(capacity, 2 * ring_record_size(q.seq.size()));
+    const string name = "/dna_ring_" + to_string(getpid());
+    const int shm = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (shm < 0) throw runtime_error("Cannot create shared memory " + name + ": " + strerror(errno));
+    const size_t size = sizeof(RingHeader) + 2 * capacity;
+    void *addr = ftruncate(shm, size) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0) : MAP_FAILED;
+    close(shm);
+    if (addr == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw runtime_error("Cannot map shared memory " + name);
+    }
+    RingHeader &h = *new (addr) RingHeader{};
+    memcpy(h.magic, RING_MAGIC, sizeof h.magic);
+    h.request_capacity = h.response_capacity = capacity;
+    char *requests = static_cast<char *>(addr) + sizeof(RingHeader);
+    const char *responses = requests + capacity;
+
+    string buffer, line;
+    send_all(fd, "ATTACH " + name + "\n");
+    const bool attached = read_reply_line(fd, buffer, line);
+    shm_unlink(name.c_str());
+    if (!attached || line.compare(0, 8, "ATTACHED") != 0) {
+        munmap(addr, size);
+        throw runtime_error("Server refused the ring: " + line);
+    }
+
+    ClientWindow window;
+    for (size_t id = 0; id < queries.size(); ++id) window.to_send.push_back(id);
+    uint64 head = 0, pos = 0;
+    for (size_t pending = queries.size(); pending;) {
+        bool progress = false;
+        while (window.can_send()) {
+            const string &seq = queries[window.to_send.front()].seq;
+            uint64 at = head;
+            if (!ring_reserve(requests, capacity, at, h.request_tail.load(memory_order_acquire), ring_record_size(seq.size()))) break;
+            const RingRecord rec{static_cast<uint32_t>(seq.size()), cls, window.to_send.front()};
+            memcpy(requests + at % capacity, &rec, sizeof rec);
+            memcpy(requests + at % capacity + sizeof rec, seq.data(), seq.size());
+            head = at + ring_record_size(seq.size());
+            h.request_head.store(head, memory_order_release);
+            window.to_send.pop_front();
+            ++window.in_flight;
+            progress = true;
+        }
+        if (progress) futex_bump(h.request_posted);
+        progress = false;
+
+        const uint32_t seen = h.response_posted.load(memory_order_acquire);
+        const uint64 response_head = h.response_head.load(memory_order_acquire);
+        for (const RingRecord *rec; (rec = ring_record_at(responses, capacity, pos, response_head));) {
+            const char *payload = reinterpret_cast<const char *>(rec + 1);
+            if (rec->kind == RING_BUSY) {
+                window.busy(rec->id);
+            } else if (rec->kind == RING_OK) {
+                const RingSegment *segs = reinterpret_cast<const RingSegment *>(payload);
+                for (size_t i = 0; i < rec->len / sizeof(RingSegment); ++i) {
+                    MatchSegment m;
+                    m.query_start = segs[i].query_start;
+                    m.query_end = segs[i].query_end;
+                    m.ref_info.start = segs[i].ref_start;
+                    m.ref_info.end = segs[i].ref_end;
+                    m.ref_info.reverse = segs[i].reverse;
+                    results[rec->id].push_back(m);
+                }
+                window.answered();
+                --pending;
+            } else {
+                errors[rec->id].assign(payload, rec->len);
+                window.answered();
+                --pending;
+            }
+            pos += ring_record_size(rec->len);
+            h.response_tail.store(pos, memory_order_release);
+            progress = true;
+        }
+        if (progress) {
+            futex_bump(h.response_freed);
+        } else if (char c; recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            munmap(addr, size);  // the server stopped reading the ring
+            throw runtime_error("Server closed the connection");
+        } else {
+            futex_wait(h.response_posted, seen, RING_POLL_MS);
+        }
+    }
+    h.closed.store(1);
+    futex_bump(h.request_posted);
+    munmap(addr, size);
+}
+
+void run_client(const string &socket_path, const string &queries_path, bool use_ring, RequestClass cls) {
+    const vector<NamedSequence> queries = read_sequences(queries_path);
+    vector<vector<MatchSegment>> results(queries.size());
+    vector<string> errors(queries.size());
+    const int fd = connect_server(socket_path);
+    try {
+        if (use_ring) client_over_ring(fd, queries, cls, results, errors);
+        else client_over_socket(fd, queries, cls, results, errors);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    for (size_t id = 0; id < queries.size(); ++id) {
+        if (!errors[id].empty()) cerr << "\033[31mError: " << queries[id].name << ": " << errors[id] << "\033[0m\n";
+    }
+    cout << "query\tquery_start\tquery_end\tref_start\tref_end\tstrand\n";
+    for (size_t id = 0; id < queries.size(); ++id) {
+        for (const MatchSegment &seg : results[id]) {
+            cout << queries[id].name << '\t' << seg.query_start << '\t' << seg.query_end << '\t'
+                 << seg.ref_info.start << '\t' << seg.ref_info.end << '\t' << (seg.ref_info.reverse ? '-' : '+') << '\n';
+        }
+    }
+}
+#else
+void run_server(const string &, const string &, const BatchOptions &, size_t) {
+    throw runtime_error("--serve needs a Linux build (Unix sockets, shared memory and futexes)");
+}
+
+void run_client(const string &, const string &, bool, RequestClass) {
+    throw runtime_error("--client needs a Linux build (Unix sockets and shared memory)");
+}
+#endif
+
+// Tuning: short probes on a sample of the real queries over thread counts,
+// dispatch batch sizes and the fast-path anchor length; the fastest setting is
+// saved as a profile that later runs load unless overridden on the command line.
+const char DEFAULT_PROFILE_PATH[] = "dna_align.profile";
+const size_t TUNE_SAMPLE_QUERIES = 256;
+const size_t TUNE_SAMPLE_BASES = 200000;
+const int TUNE_REPEATS = 2;
+
+struct TuningProfile {
+    unsigned threads = 1;
+    size_t dispatch_batch = 1;
+    size_t anchor_len = MIN_ANCHOR_LEN;
+};
+
+bool load_profile(const string &path, TuningProfile &profile) {
+    ifstream in(path);
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        line = trim(line);
+        const size_t eq = line.find('=');
+        if (line.empty() || line[0] == '#' || eq == string::npos) continue;
+        const string key = trim(line.substr(0, eq));
+        const unsigned long value = strtoul(line.c_str() + eq + 1, nullptr, 10);
+        if (value == 0) continue;
+        if (key == "threads") profile.threads = static_cast<unsigned>(value);
+        else if (key == "dispatch_batch") profile.dispatch_batch = value;
+        else if (key == "anchor_len") profile.anchor_len = value;
+    }
+    return true;
+}
+
+void save_profile(const string &path, const TuningProfile &profile) {
+    ofstream out(path, ios::trunc);
+    if (!out) throw runtime_error("Cannot write " + path);
+    out << "# written by --tune\n"
+        << "threads=" << profile.threads << '\n'
+        << "dispatch_batch=" << profile.dispatch_batch << '\n'
+        << "anchor_len=" << profile.anchor_len << '\n';
+}
+
+void run_tuning(const string &ref_path, const string &queries_path, const string &profile_path,
+                const BatchOptions &opt) {
+    const vector<NamedSequence> refs = read_sequences(ref_path);
+    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+    const string &ref = refs[0].seq;
+    const vector<NamedSequence> queries = read_sequences(queries_path);
+    if (queries.empty()) throw runtime_error("No queries in " + queries_path);
+
+    // Evenly spaced sample, bounded in count and total bases
+    vector<string> sample;
+    size_t sample_bases = 0;
+    const size_t stride = max<size_t>(1, queries.size() / TUNE_SAMPLE_QUERIES);
+    for (size_t i = 0; i < queries.size() && sample.size() < TUNE_SAMPLE_QUERIES; i += stride) {
+        if (!sample.empty() && sample_bases + queries[i].seq.size() > TUNE_SAMPLE_BASES) break;
+        sample.push_back(queries[i].seq);
+        sample_bases += queries[i].seq.size();
+    }
+
+    BatchOptions options = opt;
+    options.regions = normalize_regions(opt.regions, ref.size());
+    FlatRefTable index;
+    if (options.use_mum) options.mum_len = select_mum_length(ref, options.threads);
+    else index = build_flat_reference_index(ref, options.regions, options.bisulfite, options.threads);
+
+    vector<unsigned> thread_counts;
+    const unsigned hw = max(1u, thread::hardware_concurrency());
+    for (unsigned t = 1; t < hw; t *= 2) thread_counts.push_back(t);
+    thread_counts.push_back(hw);
+    const vector<size_t> batch_sizes = {1, 4, 16, 64};
+    const vector<size_t> anchor_lens = options.use_fast_path && !options.use_mum
+                                           ? vector<size_t>{32, 64, 128} : vector<size_t>{options.anchor_len};
+
+    cout << "Tuning on " << sample.size() << " queries (" << sample_bases << " bp)\n"
+         << "threads\tbatch\tanchor\tseconds\n";
+    TuningProfile best;
+    double best_seconds = numeric_limits<double>::max();
+    for (unsigned threads : thread_counts) {
+        for (size_t batch : batch_sizes) {
+            for (size_t anchor : anchor_lens) {
+                options.threads = threads;
+                options.dispatch_batch = batch;
+                options.anchor_len = anchor;
+                double seconds = numeric_limits<double>::max();
+                for (int r = 0; r < TUNE_REPEATS; ++r) {
+                    const auto t0 = chrono::steady_clock::now();
+                    parallel_dispatch(sample.size(), threads, batch, [&](unsigned, size_t id) {
+                        try {
+                            align_batch_query(sample[id], ref, index.view, options);
+                        } catch (const exception &) {
+                            // unalignable queries cost the same under every setting
+                        }
+                    });
+                    seconds = min(seconds, chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+                }
+                cout << threads << '\t' << batch << '\t' << anchor << '\t' << fixed << setprecision(4) << seconds << '\n';
+                if (seconds < best_seconds) {
+                    best_seconds = seconds;
+                    best = TuningProfile{threads, batch, anchor};
+                }
+            }
+        }
+    }
+    save_profile(profile_path, best);
+    cout << "Selected threads=" << best.threads << " dispatch_batch=" << best.dispatch_batch
+         << " anchor_len=" << best.anchor_len << ", saved to " << profile_path << '\n';
+}
+
+// Simulator: reads sampled from either strand of the reference with substitutions,
+// small indels and, per read, an optional tandem duplication or inversion (the
+// two events of the README example). Each FASTA header carries the true origin
+// as blocks "query_pos:ref_pos:len:strand" of bases that come from the reference.
+struct SimulationOptions {
+    size_t reads = 1000;
+    size_t read_len = 150;
+    double sub_rate = 0.001;     // per base
+    double indel_rate = 0.0005;  // per base, insertions and deletions equally likely
+    double dup_rate = 0.05;      // per read
+    double inv_rate = 0.05;      // per read
+};
+
+struct TruthBlock {
+    uint64 query_start;
+    uint64 ref_start;  // reference position of the block's first query base
+    uint64 len;
+    bool reverse;      // reverse: query base k maps to ref_start - k
+};
+
+struct SimBase {
+    char base;
+    int64_t origin;  // -1 for inserted bases
+    bool reverse;
+};
+
+vector<TruthBlock> truth_blocks(const vector<SimBase> &bases) {
+    vector<TruthBlock> blocks;
+    for (size_t i = 0; i < bases.size(); ++i) {
+        if (bases[i].origin < 0) continue;
+        if (!blocks.empty()) {
+            TruthBlock &b = blocks.back();
+            const int64_t step = b.reverse ? -1 : 1;
+            if (b.query_start + b.len == i && b.reverse == bases[i].reverse &&
+                static_cast<int64_t>(b.ref_start) + step * static_cast<int64_t>(b.len) == bases[i].origin) {
+                b.len++;
+                continue;
+            }
+        }
+        blocks.push_back({i, static_cast<uint64>(bases[i].origin), 1, bases[i].reverse});
+    }
+    return blocks;
+}
+
+void run_simulation(const string &ref_path, const SimulationOptions &opt) {
+    const vector<NamedSequence> refs = read_sequences(ref_path);
+    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+    const string &ref = refs[0].seq;
+    if (ref.size() < opt.read_len + 1) throw runtime_error("Reference is shorter than the read length");
+
+    mt19937_64 rng(hash_run_seed);
+    uniform_real_distribution<double> unit(0.0, 1.0);
+    const char alphabet[] = "ACGT";
+    auto random_base = [&]() { return alphabet[rng() % 4]; };
+
+    for (size_t r = 0; r < opt.reads; ++r) {
+        const bool reverse = rng() % 2;
+        const size_t start = rng() % (ref.size() - opt.read_len + 1);
+        vector<SimBase> bases;
+        for (size_t k = 0; k < opt.read_len; ++k) {
+            const size_t pos = reverse ? start + opt.read_len - 1 - k : start + k;
+            bases.push_back({reverse ? complement_base(ref[pos]) : ref[pos], static_cast<int64_t>(pos), reverse});
+        }
+
+        string events;
+        if (bases.size() > 20 && unit(rng) < opt.dup_rate) {
+            const size_t len = 10 + rng() % (bases.size() / 4), at = len + rng() % (bases.size() - len);
+            const vector<SimBase> dup(bases.begin() + at - len, bases.begin() + at);  // insert may reallocate
+            bases.insert(bases.begin() + at, dup.begin(), dup.end());
+            events += "dup:" + to_string(at) + ":" + to_string(len) + ";";
+        }
+        if (bases.size() > 20 && unit(rng) < opt.inv_rate) {
+            const size_t len = 10 + rng() % (bases.size() / 4), at = rng() % (bases.size() - len);
+            std::reverse(bases.begin() + at, bases.begin() + at + len);
+            for (size_t k = at; k < at + len; ++k) {
+                bases[k].base = complement_base(bases[k].base);
+                bases[k].reverse = !bases[k].reverse;
+            }
+            events += "inv:" + to_string(at) + ":" + to_string(len) + ";";
+        }
+
+        vector<SimBase> read;
+        for (const SimBase &b : bases) {
+            const double x = unit(rng);
+            if (x < opt.indel_rate / 2) continue;  // deletion
+            if (x < opt.indel_rate) read.push_back({random_base(), -1, false});
+            SimBase out = b;
+            if (unit(rng) < opt.sub_rate) {
+                while (out.base == b.base) out.base = random_base();
+            }
+            read.push_back(out);
+        }
+
+        cout << ">sim" << r << " truth=";
+        const vector<TruthBlock> blocks = truth_blocks(read);
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            cout << (i ? "," : "") << blocks[i].query_start << ':' << blocks[i].ref_start << ':' << blocks[i].len
+                 << ':' << (blocks[i].reverse ? '-' : '+');
+        }
+        if (!events.empty()) cout << " events=" << events;
+        cout << '\n';
+        for (const SimBase &b : read) cout << b.base;
+        cout << '\n';
+    }
+}
+
+// Per query base: true reference position and strand, or origin -1
+vector<pair<int64_t, bool>> parse_truth(const NamedSequence &record) {
+    vector<pair<int64_t, bool>> truth(record.seq.size(), {-1, false});
+    const size_t at = record.description.find("truth=");
+    if (at == string::npos) throw runtime_error("Query '" + record.name + "' has no truth= annotation");
+    istringstream in(record.description.substr(at + 6));
+    string block;
+    getline(in, block, ' ');
+    istringstream blocks(block);
+    while (getline(blocks, block, ',')) {
+        uint64 q, r, len;
+        char strand;
+        if (sscanf(block.c_str(), "%llu:%llu:%llu:%c", &q, &r, &len, &strand) != 4) continue;
+        for (uint64 k = 0; k < len && q + k < truth.size(); ++k) {
+            truth[q + k] = {strand == '-' ? static_cast<int64_t>(r - k) : static_cast<int64_t>(r + k), strand == '-'};
+        }
+    }
+    return truth;
+}
+
+// Runs every engine on simulated reads and reports, for bases in segments of at
+// least EVAL_MIN_SEGMENT bp, how many land on their true position and strand
+const size_t EVAL_MIN_SEGMENT = 20;
+
+void run_evaluation(const string &ref_path, const string &queries_path, const BatchOptions &base_opt) {
+    const vector<NamedSequence> refs = read_sequences(ref_path);
+    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+    const string &ref = refs[0].seq;
+    const vector<NamedSequence> queries = read_sequences(queries_path);
+    vector<vector<pair<int64_t, bool>>> truth;
+    uint64 total_bases = 0, known_bases = 0;
+    for (const NamedSequence &q : queries) {
+        truth.push_back(parse_truth(q));
+        total_bases += q.seq.size();
+        for (const auto &t : truth.back()) known_bases += t.first >= 0;
+    }
+
+    BatchOptions options = base_opt;
+    options.regions = normalize_regions(base_opt.regions, ref.size());
+    const auto t_index = chrono::steady_clock::now();
+    const FlatRefTable index = build_flat_reference_index(ref, options.regions, options.bisulfite, options.threads);
+    const double index_seconds = chrono::duration<double>(chrono::steady_clock::now() - t_index).count();
+
+    cout << "engine\tindex_s\talign_s\tbases_per_s\tsegments_per_read\tprecision\trecall\tfailed\n";
+    const pair<const char *, int> engines[] = {{"fast-path", 0}, {"exact", 1}, {"mum", 2}};
+    for (const auto &[name, engine] : engines) {
+        // MUMs match plain bases over the whole reference
+        if (engine == 2 && (options.bisulfite || !options.regions.empty())) continue;
+        BatchOptions opt = options;
+        opt.use_fast_path = engine == 0;
+        opt.use_mum = engine == 2;
+        if (opt.use_mum) opt.mum_len = select_mum_length(ref, opt.threads);
+        vector<vector<MatchSegment>> results(queries.size());
+        atomic<size_t> failed{0};
+
+        const auto t0 = chrono::steady_clock::now();
+        parallel_dispatch(queries.size(), opt.threads, opt.dispatch_batch, [&](unsigned, size_t id) {
+            try {
+                results[id] = align_batch_query(queries[id].seq, ref, index.view, opt);
+            } catch (const exception &) {
+                failed++;
+            }
+        });
+        const double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+        uint64 segments = 0, claimed = 0, correct = 0;
+        for (size_t id = 0; id < queries.size(); ++id) {
+            segments += results[id].size();
+            for (const MatchSegment &seg : results[id]) {
+                const uint64 len = seg.query_end - seg.query_start + 1;
+                if (len < EVAL_MIN_SEGMENT) continue;
+                claimed += len;
+                for (uint64 k = 0; k < len; ++k) {
+                    const auto &t = truth[id][seg.query_start + k];
+                    const int64_t placed = seg.ref_info.reverse ? static_cast<int64_t>(seg.ref_info.end - k)
+                                                                : static_cast<int64_t>(seg.ref_info.start + k);
+                    correct += t.first == placed && t.second == seg.ref_info.reverse;
+                }
+            }
+        }
+        cout << name << '\t' << fixed << setprecision(3) << (engine == 2 ? 0.0 : index_seconds) << '\t' << seconds
+             << '\t' << setprecision(0) << total_bases / max(seconds, 1e-9) << '\t' << setprecision(2)
+             << static_cast<double>(segments) / max<size_t>(1, queries.size()) << '\t' << setprecision(4)
+             << (claimed ? static_cast<double>(correct) / claimed : 0.0) << '\t'
+             << (known_bases ? static_cast<double>(correct) / known_bases : 0.0) << '\t' << failed << '\n';
+    }
+}
+
+// Genome-vs-genome synteny: unique k-mers of the reference genome are indexed,
+// the other genome is streamed from its FASTA in groups of chunks processed in
+// parallel. k-mer hits on one (anti-)diagonal merge into runs, and colinear
+// same-strand runs chain into synteny blocks; consecutive blocks are reported
+// with the breakpoint between them.
+const size_t SYNTENY_CHUNK = 1 << 20;
+const unsigned MIN_SYNTENY_K = 20;
+const uint64 MAX_SYNTENY_GAP = 10000;    // max gap inside a block, in either genome
+const uint64 MIN_SYNTENY_BLOCK = 500;    // blocks with fewer anchored bases are noise
+
+struct SyntenyBlock {
+    MatchSegment span;
+    uint64 anchored = 0;  // bases covered by runs
+    size_t runs = 0;
+};
+
+vector<SyntenyBlock> chain_synteny_blocks(vector<MatchSegment> runs) {
+    sort(runs.begin(), runs.end(), [](const MatchSegment &a, const MatchSegment &b) {
+        return a.query_start < b.query_start;
+    });
+    auto joins = [](const SyntenyBlock &b, const MatchSegment &run) {
+        if (run.ref_info.reverse != b.span.ref_info.reverse) return false;
+        if (run.query_start > b.span.query_end + MAX_SYNTENY_GAP) return false;
+        if (run.ref_info.reverse) {
+            return run.ref_info.end <= b.span.ref_info.start + MAX_SYNTENY_GAP &&
+                   run.ref_info.end + MAX_SYNTENY_GAP >= b.span.ref_info.start;
+        }
+        return run.ref_info.start + MAX_SYNTENY_GAP >= b.span.ref_info.end &&
+               run.ref_info.start <= b.span.ref_info.end + MAX_SYNTENY_GAP;
+    };
+    auto chain = [&](const vector<SyntenyBlock> &pieces) {
+        vector<SyntenyBlock> blocks;
+        for (const SyntenyBlock &p : pieces) {
+            if (!blocks.empty() && joins(blocks.back(), p.span)) {
+                SyntenyBlock &b = blocks.back();
+                const uint64 overlap = p.span.query_start <= b.span.query_end
+                                           ? min(b.span.query_end, p.span.query_end) - p.span.query_start + 1 : 0;
+                b.anchored -= min(b.anchored, overlap);
+                b.span.query_end = max(b.span.query_end, p.span.query_end);
+                b.span.ref_info.start = min(b.span.ref_info.start, p.span.ref_info.start);
+                b.span.ref_info.end = max(b.span.ref_info.end, p.span.ref_info.end);
+                b.anchored += p.anchored;
+                b.runs += p.runs;
+            } else {
+                blocks.push_back(p);
+            }
+        }
+        return blocks;
+    };
+
+    vector<SyntenyBlock> pieces;
+    for (const MatchSegment &run : runs) pieces.push_back({run, run.query_end - run.query_start + 1, 1});
+    // chain, drop blocks too small to be real, chain again across the removed noise
+    vector<SyntenyBlock> blocks = chain(pieces);
+    blocks.erase(remove_if(blocks.begin(), blocks.end(),
+                           [](const SyntenyBlock &b) { return b.anchored < MIN_SYNTENY_BLOCK; }), blocks.end());
+    return chain(blocks);
+}
+
+void print_synteny_blocks(const string &query_name, const vector<SyntenyBlock> &blocks) {
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        const SyntenyBlock &b = blocks[i];
+        cout << "block\t" << query_name << '\t' << b.span.query_start << '\t' << b.span.query_end << '\t'
+             << b.span.ref_info.start << '\t' << b.span.ref_info.end << '\t' << (b.span.ref_info.reverse ? '-' : '+')
+             << '\t' << b.anchored << '\t' << b.runs << '\n';
+    }
+    for (size_t i = 0; i + 1 < blocks.size(); ++i) {
+        const MatchSegment &a = blocks[i].span, &b = blocks[i + 1].span;
+        string type;
+        if (a.ref_info.reverse != b.ref_info.reverse) {
+            type = "inversion";
+        } else {
+            const bool backwards = a.ref_info.reverse ? b.ref_info.start > a.ref_info.end
+                                                      : b.ref_info.end < a.ref_info.start;
+            type = backwards ? (b.query_start <= a.query_end ? "duplication" : "rearrangement") : "gap";
+        }
+        cout << "breakpoint\t" << query_name << '\t' << a.query_end << '\t' << b.query_start << '\t'
+             << (a.ref_info.reverse ? a.ref_info.start : a.ref_info.end) << '\t'
+             << (b.ref_info.reverse ? b.ref_info.end : b.ref_info.start) << '\t' << type << '\n';
+    }
+}
+
+void run_synteny(const string &ref_path, const string &genome_path, unsigned threads) {
+    const vector<NamedSequence> refs = read_sequences(ref_path);
+    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+    const string &ref = refs[0].seq;
+    const unsigned k = max(MIN_SYNTENY_K, select_unique_kmer_spectrum(pack_dna(ref), threads).k);
+    const UniqueKmerIndex index = build_unique_kmer_index(ref, k, threads);
+    cerr << "Indexed " << index.positions.size() << " " << k << "-mers of " << refs[0].name << "\n";
+
+    ifstream in(genome_path);
+    if (!in) throw runtime_error("Cannot open " + genome_path);
+    cout << "#record\tquery\tq_start\tq_end\tref_start\tref_end\tstrand\tanchored_bp\truns\n"
+         << "#breakpoint\tquery\tq_before\tq_after\tref_before\tref_after\ttype\n";
+
+    // Chunks overlap by k - 1 bases so no k-mer is lost at a boundary
+    string name, buffer, line;
+    uint64 buffer_offset = 0;
+    vector<MatchSegment> runs;
+    auto process = [&](bool final) {
+        const size_t group = final ? buffer.size() : SYNTENY_CHUNK * max(1u, threads);
+        if (buffer.size() < k || (!final && buffer.size() < group + k - 1)) return;
+        vector<pair<uint64, size_t>> chunks;  // (start in buffer, length)
+        for (size_t s = 0; s + k <= min(buffer.size(), group + k - 1); s += SYNTENY_CHUNK) {
+            chunks.push_back({s, min(SYNTENY_CHUNK + k - 1, buffer.size() - s)});
+        }
+        vector<vector<MatchSegment>> found(chunks.size());
+        parallel_dispatch(chunks.size(), threads, 1, [&](unsigned, size_t c) {
+            found[c] = find_kmer_runs(index, buffer.substr(chunks[c].first, chunks[c].second),
+                                      buffer_offset + chunks[c].first);
+        });
+        for (const auto &f : found) runs.insert(runs.end(), f.begin(), f.end());
+        const size_t consumed = final ? buffer.size() : group;
+        buffer.erase(0, consumed);
+        buffer_offset += consumed;
+    };
+    auto finish_record = [&]() {
+        process(true);
+        if (!name.empty()) print_synteny_blocks(name, chain_synteny_blocks(move(runs)));
+        runs.clear();
+        buffer.clear();
+        buffer_offset = 0;
+    };
+    while (getline(in, line)) {
+        line = trim(line);
+        if (line.empty()) continue;
+        if (line[0] == '>') {
+            finish_record();
+            const string header = trim(line.substr(1));
+            name = header.substr(0, header.find_first_of(" \t"));
+            continue;
+        }
+        if (name.empty()) name = "seq1";
+        to_upper(line);
+        buffer += line;
+        process(false);
+    }
+    finish_record();
+}
+
+void print_alignment_result(const string &ref_seq, size_t query_len, const vector<MatchSegment> &result) {
+    cout << "\n\033[1;34m======== Alignment Results ========\033[0m\n";
+    cout << "Reference length: \033[33m" << ref_seq.size() << " bp\033[0m\n";
+    cout << "Query length: \033[33m" << query_len << " bp\033[0m\n";
+    cout << "\033[1;36mMatched segments: " << result.size() << "\033[0m\n\n";
+    
+    for (size_t i = 0; i < result.size(); ++i) {
+        const auto& seg = result[i];
+        const string seq = ref_seq.substr(seg.ref_info.start, 
+                                        seg.ref_info.end - seg.ref_info.start + 1);
+        cout << "\033[1;95mSegment " << i + 1 << ":\033[0m\n"
+             << "  \033[90mRef position:\033[0m [\033[35m" << seg.ref_info.start 
+             << "\033[0m-\033[35m" << seg.ref_info.end << "\033[0m]\n"
+             << "  \033[90mQuery position:\033[0m [\033[35m" << seg.query_start 
+             << "\033[0m-\033[35m" << seg.query_end << "\033[0m]\n"
+             << "  \033[90mStrand:\033[0m " 
+             << (seg.ref_info.reverse ? "\033[33mReverse complement\033[0m" : "\033[33mForward\033[0m") << "\n"
+             << "  \033[90mMatched sequence:\033[0m \033[36m" << seq << "\033[0m\n"
+             << "  \033[90mLength:\033[0m \033[32m" << seq.size() << " bp\033[0m\n\n";
+    }
+    cout << "\033[1;34m==========================\033[0m\n";
+}
+
+// Interactive curation: after the initial alignment, each line "<pos> <erase_len> [bases]"
+// edits the query and prints the updated segmentation.
+void run_incremental_session(const string &ref_seq, const string &query_seq, const vector<RefRegion> &regions) {
+    RefMap ref_map = build_reference_index(ref_seq, regions);
+    IncrementalState st = build_incremental_state(ref_map, query_seq);
+    auto current_segments = [&]() {
+        for (int attempt = 1;; ++attempt) {
+            auto segments = incremental_segments(st);
+            if (verify_segments(st.query, ref_seq, segments)) return segments;
+            if (attempt == HASH_VERIFY_ATTEMPTS) throw runtime_error("Segment verification failed");
+            ref_map = build_reference_index(ref_seq, regions);
+            st = build_incremental_state(ref_map, st.query);
+        }
+    };
+    print_alignment_result(ref_seq, st.query.size(), current_segments());
+
+    string line;
+    while (true) {
+        cout << "\n\033[1;32m>>> Edit (<pos> <erase_len> [bases], empty line to quit):\033[0m " << flush;
+        if (!getline(cin, line) || trim(line).empty()) break;
+        istringstream in(line);
+        size_t pos, erase_len;
+        string bases;
+        if (!(in >> pos >> erase_len)) {
+            cerr << "\033[31mError: expected <pos> <erase_len> [bases]\033[0m\n";
+            continue;
+        }
+        in >> bases;
+        to_upper(bases);
+        try {
+            validate_dna(bases, "Inserted bases");
+            const size_t recomputed = apply_query_edit(st, pos, erase_len, bases);
+            cout << "Recomputed \033[33m" << recomputed << "\033[0m of " << st.query.size() << " positions\n";
+            print_alignment_result(ref_seq, st.query.size(), current_segments());
+        } catch (const exception &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m\n";
+        }
+    }
+}
+
+void print_usage(const char *prog) {
+    cerr << "Usage: " << prog << " [--exact | --mum | --incremental | --spliced | --bisulfite]\n"
+         << "       " << prog << " --ref FILE --queries FILE [--binary OUT] [--exact | --mum] [--threads N]\n"
+         << "                [--barcodes FILE] [--trim-adapters | --adapters FASTA] [--variants VCF]\n"
+         << "       " << prog << " --all-vs-all FILE [--matrix OUT] [--threads N]\n"
+         << "       " << prog << " --tune --ref FILE --queries FILE [--exact | --mum] [--profile OUT]\n"
+         << "       " << prog << " --ref FILE --save-index OUT\n"
+         << "       " << prog << " --simulate N --ref FILE [--read-len L] [--sub-rate R] [--indel-rate R]\n"
+         << "                [--dup-rate R] [--inv-rate R] [--seed S]\n"
+         << "       " << prog << " --evaluate --ref FILE --queries SIMULATED [--threads N]\n"
+         << "       " << prog << " --classify DB --queries FILE [--taxonomy FILE] [--k K]\n"
+         << "       " << prog << " --ref FILE --queries FILE --classify DB --taxon ID [--taxonomy FILE]\n"
+         << "       " << prog << " --serve SOCKET --ref FILE [--threads N] [--max-queued BASES]\n"
+         << "       " << prog << " --client SOCKET --queries FILE [--ring] [--priority interactive|batch]\n"
+         << "       " << prog << " --synteny --ref GENOME --queries GENOME [--threads N]\n"
+         << "       " << prog << " --dump-binary FILE\n"
+         << "       " << prog << " --kmer-spectrum FILE [--k K] [--threads N]\n"
+         << "  --exact       Run the DP over the whole query (disable identical-region fast path)\n"
+         << "  --mum         Anchor on maximal unique matches, segment only the gaps (large inputs)\n"
+         << "  --incremental Keep the DP state and re-align after each query edit read from stdin\n"
+         << "  --ref         Reference FASTA for batch mode (first record is used)\n"
+         << "  --queries     Align every sequence of this FASTA file against the reference\n"
+         << "  --binary      Write batch results as a columnar binary file instead of TSV\n"
+         << "  --dump-binary Print a columnar result file as TSV\n"
+         << "  --kmer-spectrum Count k-mers of the first sequence in FILE (default k: first mostly-unique k)\n"
+         << "  --all-vs-all  Compare every pair of sequences in a FASTA file, write a distance matrix\n"
+         << "  --matrix      Write the PHYLIP distance matrix to OUT instead of stdout\n"
+         << "  --threads     Worker threads (default: hardware concurrency)\n"
+         << "  --seed        Fixed hash seed (default: random per run)\n"
+         << "  --region      Only match inside reference interval S-E (0-based, inclusive; repeatable)\n"
+         << "  --regions     Only match inside the intervals of a BED file (chrom start end, half-open)\n"
+         << "  --save-index  Build the reference hash index once and save it for --index\n"
+         << "  --index       mmap a saved index (warmed up in parallel at startup) instead of building one\n"
+         << "  --lock-index  mlock the mapped index after warm-up\n"
+         << "  --simulate    Write N reads sampled from the reference, with true origins in the headers\n"
+         << "  --evaluate    Align simulated reads with every engine; report precision, recall, bases/s\n"
+         << "  --serve       Keep the index loaded and answer ALIGN requests on a Unix socket\n"
+         << "  --max-queued  Queued batch bases before the server answers BUSY (interactive: a tenth)\n"
+         << "  --client      Send --queries to a running server and print its alignments\n"
+         << "  --ring        With --client: pass queries and results through shared memory\n"
+         << "  --priority    With --client: request class (default: batch)\n"
+         << "  --variants    Align against the reference plus known variants (VCF: CHROM POS ID REF ALT)\n"
+         << "  --strand-vote Search one strand per read when sampled k-mers agree on it\n"
+         << "  --reorder     Align queries grouped by minimizer for index cache locality (output order kept)\n"
+         << "  --trim-adapters Cut adapter read-through (TruSeq, Nextera, small RNA) before aligning\n"
+         << "  --adapters    Trim these adapters (FASTA) instead of the built-in set\n"
+         << "  --barcodes    Demultiplex reads by leading barcode (sample<TAB>barcode per line, 1 mismatch allowed)\n"
+         << "  --classify    Assign reads to the LCA taxon of their k-mers in DB (headers: taxid=N)\n"
+         << "  --taxonomy    Taxonomy file: taxid parent [name] per line (root is 1)\n"
+         << "  --taxon       With --ref: align only reads classified under this taxon\n"
+         << "  --spliced     RNA reads: chain exact segments across introns (GT-AG motifs favored)\n"
+         << "  --bisulfite   Match C->T converted reads (bisulfite sequencing) on both strands\n"
+         << "  --synteny     Index the --ref genome, stream --queries genome(s), print synteny blocks\n"
+         << "  --tune        Benchmark threads, dispatch batch and anchor length on the queries, save a profile\n"
+         << "  --profile     Tuning profile to write or load (default: " << DEFAULT_PROFILE_PATH << ")\n";
+}
+
+int main(int argc, char *argv[]) {
+    ios::sync_with_stdio(false);
+    cin.tie(nullptr);
+
+    bool use_fast_path = true, use_mum = false, use_incremental = false;
+    string all_vs_all_path, matrix_path, ref_path, queries_path, binary_path, dump_path, spectrum_path;
+    unsigned spectrum_k = 0;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    bool threads_given = false, use_tune = false;
+    string profile_path, index_path, save_index_path;
+    string classify_db, taxonomy_path, barcodes_path, adapters_path, variants_path, serve_path;
+    size_t max_queued = DEFAULT_MAX_QUEUED_BASES;
+    string client_path;
+    bool use_ring = false;
+    RequestClass priority = BATCH;
+    bool trim_adapters = false, reorder = false, strand_vote = false;
+    uint32_t taxon = NO_TAXON;
+    vector<RefRegion> regions;
+    bool lock_index = false, use_evaluate = false, use_simulate = false, use_synteny = false;
+    bool use_bisulfite = false, use_spliced = false;
+    SimulationOptions sim;
+    hash_run_seed = (static_cast<uint64>(random_device{}()) << 32) ^ random_device{}();
+    for (int i = 1; i < argc; ++i) {
+        const string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--exact") {
+            use_fast_path = false;
+        } else if (arg == "--mum") {
+            use_mum = true;
+        } else if (arg == "--incremental") {
+            use_incremental = true;
+        } else if (arg == "--all-vs-all" && has_value) {
+            all_vs_all_path = argv[++i];
+        } else if (arg == "--ref" && has_value) {
+            ref_path = argv[++i];
+        } else if (arg == "--queries" && has_value) {
+            queries_path = argv[++i];
+        } else if (arg == "--binary" && has_value) {
+            binary_path = argv[++i];
+        } else if (arg == "--kmer-spectrum" && has_value) {
+            spectrum_path = argv[++i];
+        } else if (arg == "--k" && has_value) {
+            spectrum_k = static_cast<unsigned>(max(1, atoi(argv[++i])));
+        } else if (arg == "--dump-binary" && has_value) {
+            dump_path = argv[++i];
+        } else if (arg == "--matrix" && has_value) {
+            matrix_path = argv[++i];
+        } else if (arg == "--seed" && has_value) {
+            hash_run_seed = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--threads" && has_value) {
+            threads = static_cast<unsigned>(max(1, atoi(argv[++i])));
+            threads_given = true;
+        } else if (arg == "--region" && has_value) {
+            const string spec = argv[++i];
+            const size_t dash = spec.find('-');
+            if (dash == string::npos || dash == 0 || dash + 1 == spec.size()) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            regions.push_back({strtoull(spec.c_str(), nullptr, 10), strtoull(spec.c_str() + dash + 1, nullptr, 10)});
+        } else if (arg == "--regions" && has_value) {
+            ifstream bed(argv[++i]);
+            if (!bed) {
+                cerr << "\033[31mError: Cannot open " << argv[i] << "\033[0m\n";
+                return 1;
+            }
+            string line, chrom;
+            uint64 start, end;
+            while (getline(bed, line)) {
+                istringstream fields(line);
+                if (line.empty() || line[0] == '#' || !(fields >> chrom >> start >> end) || end <= start) continue;
+                regions.push_back({start, end - 1});
+            }
+        } else if (arg == "--save-index" && has_value) {
+            save_index_path = argv[++i];
+        } else if (arg == "--index" && has_value) {
+            index_path = argv[++i];
+        } else if (arg == "--lock-index") {
+            lock_index = true;
+        } else if (arg == "--simulate" && has_value) {
+            use_simulate = true;
+            sim.reads = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--read-len" && has_value) {
+            sim.read_len = max<size_t>(1, strtoull(argv[++i], nullptr, 10));
+        } else if (arg == "--sub-rate" && has_value) {
+            sim.sub_rate = atof(argv[++i]);
+        } else if (arg == "--indel-rate" && has_value) {
+            sim.indel_rate = atof(argv[++i]);
+        } else if (arg == "--dup-rate" && has_value) {
+            sim.dup_rate = atof(argv[++i]);
+        } else if (arg == "--inv-rate" && has_value) {
+            sim.inv_rate = atof(argv[++i]);
+        } else if (arg == "--serve" && has_value) {
+            serve_path = argv[++i];
+        } else if (arg == "--max-queued" && has_value) {
+            max_queued = static_cast<size_t>(max(1LL, atoll(argv[++i])));
+        } else if (arg == "--client" && has_value) {
+            client_path = argv[++i];
+        } else if (arg == "--ring") {
+            use_ring = true;
+        } else if (arg == "--priority" && has_value) {
+            priority = string(argv[++i]) == "interactive" ? INTERACTIVE : BATCH;
+        } else if (arg == "--variants" && has_value) {
+            variants_path = argv[++i];
+        } else if (arg == "--reorder") {
+            reorder = true;
+        } else if (arg == "--strand-vote") {
+            strand_vote = true;
+        } else if (arg == "--trim-adapters") {
+            trim_adapters = true;
+        } else if (arg == "--adapters" && has_value) {
+            adapters_path = argv[++i];
+            trim_adapters = true;
+        } else if (arg == "--barcodes" && has_value) {
+            barcodes_path = argv[++i];
+        } else if (arg == "--classify" && has_value) {
+            classify_db = argv[++i];
+        } else if (arg == "--taxonomy" && has_value) {
+            taxonomy_path = argv[++i];
+        } else if (arg == "--taxon" && has_value) {
+            taxon = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--spliced") {
+            use_spliced = true;
+        } else if (arg == "--bisulfite") {
+            use_bisulfite = true;
+        } else if (arg == "--synteny") {
+            use_synteny = true;
+        } else if (arg == "--evaluate") {
+            use_evaluate = true;
+        } else if (arg == "--tune") {
+            use_tune = true;
+        } else if (arg == "--profile" && has_value) {
+            profile_path = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!index_path.empty() && (!regions.empty() || use_mum || use_incremental)) {
+        cerr << "\033[31mError: --index cannot be combined with --region, --mum or --incremental\033[0m\n";
+        return 1;
+    }
+    if (use_bisulfite && (use_mum || use_incremental || !index_path.empty() || !save_index_path.empty())) {
+        cerr << "\033[31mError: --bisulfite cannot be combined with --mum, --incremental, --index or --save-index\033[0m\n";
+        return 1;
+    }
+    if (use_spliced && (use_mum || use_incremental || use_bisulfite || !index_path.empty())) {
+        cerr << "\033[31mError: --spliced cannot be combined with --mum, --incremental, --bisulfite or --index\033[0m\n";
+        return 1;
+    }
+    if (!variants_path.empty() && (use_mum || use_incremental || use_bisulfite || use_spliced || !index_path.empty() ||
+                                   !regions.empty())) {
+        cerr << "\033[31mError: --variants cannot be combined with --mum, --incremental, --bisulfite, --spliced, "
+                "--index or regions\033[0m\n";
+        return 1;
+    }
+    if (strand_vote && (use_mum || use_incremental || use_spliced || !variants_path.empty())) {
+        cerr << "\033[31mError: --strand-vote cannot be combined with --mum, --incremental, --spliced or --variants\033[0m\n";
+        return 1;
+    }
+    if (use_mum && !regions.empty()) {
+        cerr << "\033[31mError: --mum does not support region restriction\033[0m\n";
+        return 1;
+    }
+    if (!serve_path.empty() && (use_spliced || !variants_path.empty() || !index_path.empty())) {
+        cerr << "\033[31mError: --serve cannot be combined with --spliced, --variants or --index\033[0m\n";
+        return 1;
+    }
+    if ((use_tune || use_evaluate || use_synteny) && (ref_path.empty() || queries_path.empty())) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!classify_db.empty() && (queries_path.empty() || (!ref_path.empty() && taxon == NO_TAXON))) {
+        cerr << "\033[31mError: --classify needs --queries, and --taxon when reads are aligned to --ref\033[0m\n";
+        return 1;
+    }
+    if (!serve_path.empty() && ref_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (use_simulate && ref_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!client_path.empty()) {
+        if (queries_path.empty()) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        try {
+            run_client(client_path, queries_path, use_ring, priority);
+        } catch (const exception &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // Settings from an earlier --tune apply unless given explicitly
+    TuningProfile profile;
+    profile.threads = threads;
+    if (!use_tune && load_profile(profile_path.empty() ? DEFAULT_PROFILE_PATH : profile_path, profile)) {
+        if (!threads_given) threads = profile.threads;
+        cerr << "Using tuning profile " << (profile_path.empty() ? DEFAULT_PROFILE_PATH : profile_path)
+             << " (threads=" << threads << ", dispatch_batch=" << profile.dispatch_batch
+             << ", anchor_len=" << profile.anchor_len << ")\n";
+    }
+
+    if (!all_vs_all_path.empty() || !dump_path.empty() || !queries_path.empty() || !spectrum_path.empty() ||
+        !save_index_path.empty() || use_simulate || !serve_path.empty()) {
+        if ((!queries_path.empty() || !save_index_path.empty()) && ref_path.empty() && classify_db.empty()) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        try {
+            if (!all_vs_all_path.empty()) {
+                run_all_vs_all(all_vs_all_path, matrix_path, threads);
+            } else if (!spectrum_path.empty()) {
+                run_kmer_spectrum(spectrum_path, spectrum_k, threads);
+            } else if (!dump_path.empty()) {
+                dump_columnar_results(dump_path);
+            } else if (!classify_db.empty() && ref_path.empty()) {
+                run_classification(classify_db, taxonomy_path, queries_path, spectrum_k ? spectrum_k : CLASSIFY_K, threads);
+            } else {
+                BatchOptions batch;
+                batch.use_fast_path = use_fast_path;
+                batch.use_mum = use_mum;
+                batch.threads = threads;
+                batch.dispatch_batch = profile.dispatch_batch;
+                batch.anchor_len = profile.anchor_len;
+                batch.binary_path = binary_path;
+                batch.regions = regions;
+                batch.index_path = index_path;
+                batch.lock_index = lock_index;
+                batch.bisulfite = use_bisulfite;
+                batch.spliced = use_spliced;
+                batch.barcodes_path = barcodes_path;
+                batch.trim_adapters = trim_adapters;
+                batch.reorder = reorder;
+                batch.strand_vote = strand_vote;
+                batch.adapters_path = adapters_path;
+                batch.variants_path = variants_path;
+                batch.classify_db = classify_db;
+                batch.taxonomy_path = taxonomy_path;
+                batch.taxon = taxon;
+                if (spectrum_k) batch.classify_k = spectrum_k;
+                if (!serve_path.empty()) {
+                    run_server(ref_path, serve_path, batch, max_queued);
+                } else if (use_simulate) {
+                    run_simulation(ref_path, sim);
+                } else if (!save_index_path.empty()) {
+                    const vector<NamedSequence> refs = read_sequences(ref_path);
+                    if (refs.empty()) throw runtime_error("No reference sequence in " + ref_path);
+                    save_reference_index(refs[0].seq, save_index_path, threads);
+                } else if (use_synteny) {
+                    run_synteny(ref_path, queries_path, threads);
+                } else if (use_evaluate) {
+                    run_evaluation(ref_path, queries_path, batch);
+                } else if (use_tune) {
+                    run_tuning(ref_path, queries_path, profile_path.empty() ? DEFAULT_PROFILE_PATH : profile_path, batch);
+                } else {
+                    run_batch(ref_path, queries_path, batch);
+                }
+            }
+        } catch (const exception &e) {
+            cerr << "\033[31mError: " << e.what() << "\033[0m\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    // UI Initialization
+    cout << "\033[1;34m\n======== DNA Sequence Alignment Tool ========\033[0m\n";
+    
+    // Reference sequence input
+    cout << "\n\033[1;32m>>> Step 1/2: Enter Reference Sequence (long)\033[0m\n";
+    cout << "Enter reference sequence (A/T/C/G only): \033[36m" << flush;
+    string ref_seq;
+    if (!getline(cin, ref_seq)) {
+        cerr << "\033[31m\nError: Failed to read input\033[0m\n";
+        return 1;
+    }
+    ref_seq = trim(ref_seq);
+    to_upper(ref_seq);
+    if (ref_seq.empty()) {
+        cerr << "\033[31m\nError: Reference sequence cannot be empty\033[0m\n";
+        return 1;
+    }
+    cout << "\033[0m"; // Reset color
+
+    // Query sequence input
+    cout << "\n\033[1;32m>>> Step 2/2: Enter Query Sequence (short)\033[0m\n";
+    cout << "Enter query sequence (A/T/C/G only): \033[36m" << flush;
+    string query_seq;
+    if (!getline(cin, query_seq)) {
+        cerr << "\033[31m\nError: Failed to read input\033[0m\n";
+        return 1;
+    }
+    query_seq = trim(query_seq);
+    to_upper(query_seq);
+    if (query_seq.empty()) {
+        cerr << "\033[31m\nError: Query sequence cannot be empty\033[0m\n";
+        return 1;
+    }
+    cout << "\033[0m"; // Reset color
+
+    try {
+        // Validation
+        validate_dna(ref_seq, "Reference sequence");
+        validate_dna(query_seq, "Query sequence");
+        regions = normalize_regions(regions, ref_seq.size());
+
+        if (use_incremental) {
+            run_incremental_session(ref_seq, query_seq, regions);
+            return 0;
+        }
+
+        // Build hash map lazily: a query fully covered by identical anchors never needs it
+        RefMap ref_map;
+        unique_ptr<MappedIndex> mapped;
+        if (!index_path.empty()) mapped = open_reference_index(index_path, ref_seq, threads, lock_index);
+        auto search = [&](string_view window, const auto &index) {
+            // same strand pre-detection as batch mode; never under bisulfite conversion
+            const int strand = strand_vote && !use_bisulfite ? vote_strand(window, index) : 0;
+            return strand ? segment_one_strand(window, index, strand < 0)
+                          : reconstruct_path(find_optimal_path(window, index), window.size());
+        };
+        auto align_window = [&](string_view window) {
+            if (mapped) {
+                auto segments = search(window, mapped->view);
+                if (verify_segments(window, ref_seq, segments)) return segments;
+            }
+            if (ref_map.empty()) ref_map = build_reference_index(ref_seq, regions, use_bisulfite);
+            auto segments = search(window, ref_map);
+            if (verify_segments(window, ref_seq, segments, use_bisulfite)) return segments;
+            return segment_verified(window, ref_seq, ref_map, regions);
+        };
+
+        // Find optimal path
+        vector<MatchSegment> result;
+        vector<Variant> variants;
+        GraphIndex graph;
+        vector<SpliceJunction> junctions;
+        if (!variants_path.empty()) {
+            variants = read_variants(variants_path, ref_seq);
+            graph = build_graph_index(ref_seq, variants);
+        }
+        if (!variants_path.empty()) result = align_graph_query(query_seq, ref_seq, graph, variants);
+        else if (use_spliced) result = align_spliced(query_seq, ref_seq, build_spliced_index(ref_seq, threads, regions), &junctions);
+        else if (use_mum) result = align_by_mums(query_seq, ref_seq, select_mum_length(ref_seq, threads));
+        else if (use_fast_path) result = align_with_fast_path(query_seq, ref_seq, profile.anchor_len, regions, align_window);
+        else result = align_window(query_seq);
+
+        print_alignment_result(ref_seq, query_seq.size(), result);
+        for (const MatchSegment &seg : result) {
+            if (variants_path.empty()) break;
+            const string alleles = graph_segment_alleles(query_seq, graph, variants, seg);
+            if (!alleles.empty()) {
+                cout << "\033[1;95mKnown alleles in query [" << seg.query_start << "-" << seg.query_end
+                     << "]:\033[0m \033[33m" << alleles << "\033[0m\n";
+            }
+        }
+        if (use_spliced) {
+            for (const SpliceJunction &j : junctions) {
+                cout << "\033[1;95mIntron:\033[0m [\033[35m" << j.donor << "\033[0m-\033[35m" << j.acceptor
+                     << "\033[0m] " << j.acceptor - j.donor + 1 << " bp, motif \033[33m" << j.motif << "\033[0m\n";
+            }
+        }
 
     } catch (const exception &e) {
         cerr << "\n\033[31mError: " << e.what() << "\033[0m\n";
@@ -0,0 +1,83 @@
+// Incremental engine check: random edits against a fresh rebuild, and the
+// number of recomputed starts against the starts whose probe reaches the edit.
+//   g++ -std=c++17 -O2 -pthread tests/incremental_edit_test.cpp -o incremental_edit_test && ./incremental_edit_test
+#define main dna_main
+#include "../test1.cpp"
+#undef main
+
+const char BASES[] = "ACGT";
+
+// Starts left of pos that the edit can reach: their old probe ends at or past
+// pos, or past the leftmost start whose delta the edit changed
+size_t reachable_starts(const IncrementalState &before, const IncrementalState &after, size_t pos) {
+    size_t frontier = pos;
+    for (size_t i = 0; i < pos; ++i) {
+        if (before.delta[i] != after.delta[i]) {
+            frontier = i;
+            break;
+        }
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < pos; ++i) count += i + before.probe_len[i] >= frontier;
+    return count;
+}
+
+// One random substitution, insertion or deletion; false on a wrong state or an unbounded recompute
+bool check_edit(const RefMap &map, IncrementalState &st, mt19937_64 &rng, size_t &recomputed) {
+    const size_t pos = rng() % st.query.size();
+    size_t erase_len = 0;
+    string insert;
+    switch (rng() % 3) {
+        case 0: erase_len = 1; insert = string(1, BASES[rng() % 4]); break;
+        case 1: insert = string(1, BASES[rng() % 4]); break;
+        default: erase_len = st.query.size() > 1; break;
+    }
+    const IncrementalState before = st;
+    recomputed = apply_query_edit(st, pos, erase_len, insert);
+    const IncrementalState fresh = build_incremental_state(map, st.query);
+    if (st.delta != fresh.delta || st.seg_len != fresh.seg_len || st.probe_len != fresh.probe_len) {
+        cerr << "FAIL: state after edit at " << pos << " differs from a rebuild\n";
+        return false;
+    }
+    const size_t bound = insert.size() + reachable_starts(before, fresh, pos);
+    if (recomputed > bound) {
+        cerr << "FAIL: edit at " << pos << " recomputed " << recomputed << " starts, bound " << bound << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    mt19937_64 rng(7);
+    string ref(1000, 'A');
+    for (char &c : ref) c = BASES[rng() % 4];
+    string query = ref.substr(50, 900);  // near-identical: three substitutions
+    for (int m = 0; m < 3; ++m) {
+        const size_t p = rng() % query.size();
+        query[p] = query[p] == 'A' ? 'C' : 'A';
+    }
+    const RefMap map = build_reference_index(ref);
+
+    // one edit at a time on the near-identical query
+    size_t total = 0, recomputed = 0;
+    const int single_edits = 200;
+    for (int e = 0; e < single_edits; ++e) {
+        IncrementalState st = build_incremental_state(map, query);
+        if (!check_edit(map, st, rng, recomputed)) return 1;
+        total += recomputed;
+    }
+    const double mean = static_cast<double>(total) / single_edits;
+    if (mean > query.size() / 4.0) {
+        cerr << "FAIL: a single edit recomputes " << mean << " of " << query.size() << " starts on average\n";
+        return 1;
+    }
+
+    // a chain of edits on one state
+    IncrementalState st = build_incremental_state(map, query);
+    for (int e = 0; e < 300; ++e) {
+        if (!check_edit(map, st, rng, recomputed)) return 1;
+    }
+    cout << "OK: " << single_edits << " single edits recompute " << mean << " of " << query.size()
+         << " starts on average; 300 chained edits match a rebuild\n";
+    return 0;
+}